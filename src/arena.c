@@ -0,0 +1,62 @@
+#include "arena.h"
+
+#include <lt/mem.h>
+#include <lt/str.h>
+
+#include <string.h>
+
+#define alloc lt_libc_heap
+
+// bump allocator for data that lives until the filesystem is unmounted.
+// nothing is freed individually, the blocks are released all at once.
+
+struct arena_block {
+	arena_block_t* next;
+	usz size;
+	usz used;
+	u8 data[];
+};
+
+void arena_init(arena_t* arena, usz block_size) {
+	*arena = (arena_t) {
+			.block_size = block_size };
+}
+
+void arena_free(arena_t* arena) {
+	for (arena_block_t* it = arena->head, *next; it; it = next) {
+		next = it->next;
+		lt_mfree(alloc, it);
+	}
+	arena->head = NULL;
+	arena->total = 0;
+}
+
+void* arena_alloc(arena_t* arena, usz size, usz align) {
+	arena_block_t* block = arena->head;
+	usz offs = block ? (block->used + align - 1) & ~(align - 1) : 0;
+
+	if (!block || offs + size > block->size) {
+		usz block_size = arena->block_size;
+		if (size + align > block_size)
+			block_size = size + align;
+
+		block = lt_malloc(alloc, sizeof(arena_block_t) + block_size);
+		LT_ASSERT(block != NULL);
+		*block = (arena_block_t) {
+				.next = arena->head,
+				.size = block_size };
+		arena->head = block;
+		arena->total += block_size;
+		offs = 0;
+	}
+
+	block->used = offs + size;
+	return block->data + offs;
+}
+
+char* arena_strdup(arena_t* arena, lstr_t str) {
+	char* out = arena_alloc(arena, str.len + 1, 1);
+	memcpy(out, str.str, str.len);
+	out[str.len] = 0;
+	return out;
+}
@@ -0,0 +1,21 @@
+#ifndef ARENA_H
+#define ARENA_H 1
+
+#include <lt/fwd.h>
+
+typedef struct arena_block arena_block_t;
+
+typedef
+struct arena {
+	arena_block_t* head;
+	usz block_size;
+	usz total;
+} arena_t;
+
+void arena_init(arena_t* arena, usz block_size);
+void arena_free(arena_t* arena);
+
+void* arena_alloc(arena_t* arena, usz size, usz align);
+char* arena_strdup(arena_t* arena, lstr_t str);
+
+#endif
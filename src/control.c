@@ -0,0 +1,455 @@
+#define _GNU_SOURCE
+
+#include "control.h"
+#include "vfs.h"
+#include "mod.h"
+#include "fs.h"
+
+#include <lt/mem.h>
+#include <lt/str.h>
+#include <lt/thread.h>
+#include <lt/io.h>
+#include <lt/conf.h>
+#include <lt/darr.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#define alloc lt_libc_heap
+
+// the mounted vfs listens on a unix socket in the profile directory. every connection
+// carries a single command line, which is answered before the connection is closed.
+// commands are handled one at a time on the control thread.
+
+#define CONTROL_LINE_MAX 4096
+#define CONTROL_TIMEOUT_SEC 5
+
+static int listen_fd = -1;
+static lt_thread_t* thread = NULL;
+static char* sock_path = NULL;
+static char* mods_path = NULL;
+static lstr_t conf_path = { 0 };
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static b8 unmount_requested = 0;
+
+static
+void reply_ok(int fd) {
+	write_all(fd, "ok\n", 3);
+}
+
+static
+void reply_line(int fd, lstr_t line) {
+	write_all(fd, line.str, line.len);
+	write_all(fd, "\n", 1);
+	lt_mfree(alloc, line.str);
+}
+
+static
+void reply_error(int fd, lstr_t msg) {
+	write_all(fd, "error\n", 6);
+	reply_line(fd, msg);
+}
+
+// mod names may contain spaces, so they always come last
+static
+b8 parse_pos_name(char* args, usz* out_pos, char** out_name) {
+	char* end;
+	*out_pos = strtoul(args, &end, 10);
+	if (end == args || *end != ' ' || !end[1])
+		return 0;
+	*out_name = end + 1;
+	return 1;
+}
+
+// mods that were not enabled when mounting are opened and registered on first use
+static
+mod_t* open_mod(lstr_t name) {
+	mod_t* mod = mod_find(name);
+	if (mod)
+		return mod;
+
+	if (!name.len || memchr(name.str, '/', name.len) || lt_lseq(name, CLSTR(".")) || lt_lseq(name, CLSTR("..")))
+		return NULL;
+
+	char* path = lt_lsbuild(alloc, "%s/%S%c", mods_path, name, 0).str;
+	int fd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	lt_mfree(alloc, path);
+	if (fd < 0)
+		return NULL;
+
+	mod = lt_malloc(alloc, sizeof(mod_t));
+	LT_ASSERT(mod != NULL);
+	*mod = (mod_t) {
+			.name = lt_strdup(alloc, name),
+			.rootfd = fd };
+	mod_register(mod);
+	return mod;
+}
+
+static
+void reply_result(int fd, lt_err_t err, char* name) {
+	switch (err) {
+	case LT_SUCCESS: reply_ok(fd); break;
+	case LT_ERR_EXISTS: reply_error(fd, lt_lsbuild(alloc, "mod '%s' is already enabled", name)); break;
+	case LT_ERR_NOT_FOUND: reply_error(fd, lt_lsbuild(alloc, "mod '%s' is not enabled", name)); break;
+	default: reply_error(fd, lt_lsbuild(alloc, "failed to scan mod '%s'", name)); break;
+	}
+}
+
+static
+void cmd_enable(int fd, char* args) {
+	usz pos;
+	char* name;
+	if (!parse_pos_name(args, &pos, &name)) {
+		reply_error(fd, lt_lsbuild(alloc, "expected a position and a name after 'enable'"));
+		return;
+	}
+
+	mod_t* mod = open_mod(lt_lsfroms(name));
+	if (!mod) {
+		reply_error(fd, lt_lsbuild(alloc, "mod '%s' is not present in mods directory", name));
+		return;
+	}
+	reply_result(fd, vfs_mod_enable(mod, pos), name);
+}
+
+static
+void cmd_disable(int fd, char* args) {
+	mod_t* mod = mod_find(lt_lsfroms(args));
+	reply_result(fd, mod ? vfs_mod_disable(mod) : LT_ERR_NOT_FOUND, args);
+}
+
+static
+void cmd_move(int fd, char* args) {
+	usz pos;
+	char* name;
+	if (!parse_pos_name(args, &pos, &name)) {
+		reply_error(fd, lt_lsbuild(alloc, "expected a position and a name after 'move'"));
+		return;
+	}
+
+	mod_t* mod = mod_find(lt_lsfroms(name));
+	reply_result(fd, mod ? vfs_mod_move(mod, pos) : LT_ERR_NOT_FOUND, name);
+}
+
+static
+void reply_text(int fd, lstr_t text) {
+	reply_ok(fd);
+	write_all(fd, text.str, text.len);
+	lt_mfree(alloc, text.str);
+}
+
+static
+void cmd_status(int fd, char* args) {
+	reply_text(fd, vfs_status());
+}
+
+static
+void cmd_stats(int fd, char* args) {
+	reply_text(fd, vfs_stats());
+}
+
+static
+void cmd_unmount(int fd, char* args) {
+	reply_ok(fd);
+
+	pthread_mutex_lock(&lock);
+	unmount_requested = 1;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+static
+b8 mods_contain(lt_darr(mod_t*) mods, usz count, mod_t* mod) {
+	for (usz i = 0; i < count; ++i) {
+		if (mods[i] == mod)
+			return 1;
+	}
+	return 0;
+}
+
+// bring the mounted load order in line with the mods listed in profile.conf,
+// every change that was made is reported on a line of its own
+static
+void cmd_reload(int fd, char* args) {
+	lstr_t data;
+	if (lt_freadallp(conf_path, &data, alloc) != LT_SUCCESS) {
+		reply_error(fd, lt_lsbuild(alloc, "failed to read '%S': %s", conf_path, lt_os_err_str()));
+		return;
+	}
+
+	lt_conf_t cf;
+	lt_conf_err_info_t err_info;
+	if (lt_conf_parse(&cf, data.str, data.len, &err_info, alloc) != LT_SUCCESS) {
+		reply_error(fd, lt_lsbuild(alloc, "failed to parse '%S': %S", conf_path, err_info.err_str));
+		lt_mfree(alloc, data.str);
+		return;
+	}
+
+	reply_ok(fd);
+
+	lt_darr(mod_t*) mods = lt_darr_create(mod_t*, 64, alloc);
+	LT_ASSERT(mods != NULL);
+
+	lt_conf_t* mods_cf = lt_conf_find_array(&cf, CLSTR("mods"), NULL);
+	for (usz i = 0; mods_cf && i < mods_cf->child_count; ++i) {
+		lt_conf_t* mod_cf = &mods_cf->children[i];
+		if (mod_cf->stype != LT_CONF_STRING)
+			continue;
+
+		mod_t* mod = open_mod(mod_cf->str_val);
+		if (!mod) {
+			reply_line(fd, lt_lsbuild(alloc, "missing %S", mod_cf->str_val));
+			continue;
+		}
+		if (!mods_contain(mods, lt_darr_count(mods), mod))
+			lt_darr_push(mods, mod);
+	}
+
+	// mods that are no longer listed go first, so that positions only count the listed ones
+	for (usz i = vfs_mod_count(); i > 0; --i) {
+		mod_t* mod = vfs_mod_at(i);
+		if (mods_contain(mods, lt_darr_count(mods), mod))
+			continue;
+
+		if (vfs_mod_disable(mod) == LT_SUCCESS)
+			reply_line(fd, lt_lsbuild(alloc, "disabled %S", mod->name));
+		else
+			reply_line(fd, lt_lsbuild(alloc, "failed %S", mod->name));
+	}
+
+	for (usz i = 0; i < lt_darr_count(mods); ++i) {
+		usz pos = i + 1;
+		mod_t* mod = mods[i];
+		if (pos <= vfs_mod_count() && vfs_mod_at(pos) == mod)
+			continue;
+
+		char* change = "enabled";
+		lt_err_t err = vfs_mod_enable(mod, pos);
+		if (err == LT_ERR_EXISTS) {
+			change = "moved";
+			err = vfs_mod_move(mod, pos);
+		}
+
+		if (err == LT_SUCCESS)
+			reply_line(fd, lt_lsbuild(alloc, "%s %uz %S", change, pos, mod->name));
+		else
+			reply_line(fd, lt_lsbuild(alloc, "failed %S", mod->name));
+	}
+
+	lt_darr_destroy(mods);
+	lt_conf_free(&cf, alloc);
+	lt_mfree(alloc, data.str);
+}
+
+typedef
+struct control_cmd {
+	char* name;
+	void (*handler)(int fd, char* args);
+} control_cmd_t;
+
+static control_cmd_t commands[] = {
+	{ "enable", cmd_enable },
+	{ "disable", cmd_disable },
+	{ "move", cmd_move },
+	{ "reload", cmd_reload },
+	{ "status", cmd_status },
+	{ "stats", cmd_stats },
+	{ "unmount", cmd_unmount },
+};
+
+static
+void control_handle(int fd) {
+	// a client that never finishes its line should not hold up the control thread
+	struct timeval timeout = { .tv_sec = CONTROL_TIMEOUT_SEC };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	char line[CONTROL_LINE_MAX];
+	usz len = 0;
+	while (len < sizeof(line) - 1) {
+		isz res = read(fd, line + len, sizeof(line) - 1 - len);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			break;
+		len += res;
+		if (memchr(line, '\n', len))
+			break;
+	}
+	line[len] = 0;
+
+	char* nl = strchr(line, '\n');
+	if (!nl) {
+		reply_error(fd, lt_lsbuild(alloc, "incomplete command"));
+		return;
+	}
+	*nl = 0;
+
+	char* args = strchr(line, ' ');
+	if (args)
+		*args++ = 0;
+	else
+		args = "";
+
+	for (usz i = 0; i < sizeof(commands) / sizeof(*commands); ++i) {
+		if (strcmp(commands[i].name, line) == 0) {
+			commands[i].handler(fd, args);
+			return;
+		}
+	}
+	reply_error(fd, lt_lsbuild(alloc, "unrecognized command '%s'", line));
+}
+
+static
+void control_proc(void* usr) {
+	for (;;) {
+		int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+
+		control_handle(fd);
+		close(fd);
+	}
+}
+
+static
+b8 sock_addr(char* path, struct sockaddr_un* out) {
+	*out = (struct sockaddr_un) { .sun_family = AF_UNIX };
+	usz len = strlen(path);
+	if (len >= sizeof(out->sun_path))
+		return 0;
+	memcpy(out->sun_path, path, len + 1);
+	return 1;
+}
+
+lt_err_t control_start(char* sock_path_, char* mods_path_, lstr_t conf_path_) {
+	struct sockaddr_un addr;
+	if (!sock_addr(sock_path_, &addr)) {
+		lt_werrf("control socket path '%s' is too long\n", sock_path_);
+		return LT_ERR_UNKNOWN;
+	}
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (listen_fd < 0)
+		goto err0;
+
+	// a socket left behind by a mount that did not exit cleanly is replaced
+	unlink(sock_path_);
+	if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, 8) < 0)
+		goto err1;
+
+	sock_path = strdup(sock_path_);
+	mods_path = strdup(mods_path_);
+	conf_path = lt_strdup(alloc, conf_path_);
+	unmount_requested = 0;
+
+	thread = lt_thread_create(control_proc, NULL, alloc);
+	if (!thread)
+		lt_ferrf("failed to create thread\n");
+	return LT_SUCCESS;
+
+err1:	close(listen_fd);
+		listen_fd = -1;
+err0:	lt_werrf("failed to create control socket '%s': %s\n", sock_path_, lt_os_err_str());
+		return LT_ERR_UNKNOWN;
+}
+
+void control_stop(void) {
+	if (!thread)
+		return;
+
+	// wakes the control thread from accept
+	shutdown(listen_fd, SHUT_RDWR);
+	while (!lt_thread_join(thread, alloc))
+		;
+	thread = NULL;
+
+	close(listen_fd);
+	listen_fd = -1;
+	unlink(sock_path);
+
+	free(sock_path);
+	free(mods_path);
+	lt_mfree(alloc, conf_path.str);
+	sock_path = mods_path = NULL;
+	conf_path = LSTR(NULL, 0);
+}
+
+b8 control_wait_unmount(usz msec) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += msec / 1000;
+	ts.tv_nsec += (msec % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		++ts.tv_sec;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&lock);
+	if (!unmount_requested && msec)
+		pthread_cond_timedwait(&cond, &lock, &ts);
+	b8 requested = unmount_requested;
+	pthread_mutex_unlock(&lock);
+	return requested;
+}
+
+lt_err_t control_request(char* sock_path, lstr_t cmd, lstr_t* out_reply) {
+	struct sockaddr_un addr;
+	if (!sock_addr(sock_path, &addr))
+		return LT_ERR_NOT_FOUND;
+
+	int fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return LT_ERR_UNKNOWN;
+
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		int err = errno;
+		close(fd);
+		return err == ENOENT || err == ECONNREFUSED ? LT_ERR_NOT_FOUND : LT_ERR_UNKNOWN;
+	}
+
+	if (write_all(fd, cmd.str, cmd.len) < 0 || write_all(fd, "\n", 1) < 0) {
+		close(fd);
+		return LT_ERR_UNKNOWN;
+	}
+
+	usz size = 0, cap = 256;
+	char* reply = lt_malloc(alloc, cap);
+	LT_ASSERT(reply != NULL);
+	for (;;) {
+		if (size == cap) {
+			cap *= 2;
+			reply = lt_mrealloc(alloc, reply, cap);
+			LT_ASSERT(reply != NULL);
+		}
+
+		isz res = read(fd, reply + size, cap - size);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res < 0) {
+			lt_mfree(alloc, reply);
+			close(fd);
+			return LT_ERR_UNKNOWN;
+		}
+		if (res == 0)
+			break;
+		size += res;
+	}
+	close(fd);
+
+	*out_reply = LSTR(reply, size);
+	return LT_SUCCESS;
+}
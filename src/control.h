@@ -0,0 +1,20 @@
+#ifndef CONTROL_H
+#define CONTROL_H 1
+
+#include <lt/fwd.h>
+#include <lt/err.h>
+
+// serve commands for the mounted vfs on a unix socket.
+// mods are enabled from mods_path, and 'reload' reads the load order from conf_path.
+lt_err_t control_start(char* sock_path, char* mods_path, lstr_t conf_path);
+void control_stop(void);
+
+// wait for up to msec milliseconds, returns true once a client asked to unmount
+b8 control_wait_unmount(usz msec);
+
+// send a single command line to a running mount. the reply starts with a line holding either
+// 'ok' or 'error', which is followed by the result or the error message.
+// returns LT_ERR_NOT_FOUND if nothing is listening on the socket.
+lt_err_t control_request(char* sock_path, lstr_t cmd, lstr_t* out_reply);
+
+#endif
@@ -0,0 +1,301 @@
+#define _GNU_SOURCE
+
+#include "dircache.h"
+#include "mod.h"
+#include "fs_nocase.h"
+
+#include <lt/mem.h>
+#include <lt/str.h>
+#include <lt/io.h>
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define alloc lt_libc_heap
+
+// LRU cache of O_PATH descriptors for backing directories, keyed on (mod, directory inode).
+// entries are chained into hash buckets and a doubly linked recency list by index.
+// the cache is split into independently locked shards, and descriptors are only used
+// while their shard is locked so that eviction can never close one that is in use.
+
+#define NIL ((u32)-1)
+
+#define SHARD_COUNT 16
+
+typedef
+struct dircache_ent {
+	mod_t* mod;
+	usz dir_id;
+	int fd;
+
+	u32 hash_next;
+	u32 lru_prev;
+	u32 lru_next;
+} dircache_ent_t;
+
+typedef
+struct dircache_shard {
+	pthread_mutex_t lock;
+
+	dircache_ent_t* ents;
+	u32* buckets;
+	u32 bucket_mask;
+	u32 ent_count;
+	u32 ent_max;
+	u32 lru_head;
+	u32 lru_tail;
+
+	usz hits;
+	usz misses;
+} dircache_shard_t;
+
+static dircache_shard_t shards[SHARD_COUNT];
+static b8 enabled = 0;
+
+void dircache_init(usz size) {
+	enabled = size != 0;
+	if (!enabled)
+		return;
+
+	usz shard_size = (size + SHARD_COUNT - 1) / SHARD_COUNT;
+
+	u32 bucket_count = 4;
+	while (bucket_count < shard_size)
+		bucket_count <<= 1;
+
+	for (usz i = 0; i < SHARD_COUNT; ++i) {
+		dircache_shard_t* shard = &shards[i];
+		*shard = (dircache_shard_t) {
+				.bucket_mask = bucket_count - 1,
+				.ent_max = shard_size,
+				.lru_head = NIL,
+				.lru_tail = NIL };
+		pthread_mutex_init(&shard->lock, NULL);
+
+		shard->ents = lt_malloc(alloc, shard_size * sizeof(dircache_ent_t));
+		LT_ASSERT(shard->ents != NULL);
+		shard->buckets = lt_malloc(alloc, bucket_count * sizeof(u32));
+		LT_ASSERT(shard->buckets != NULL);
+		memset(shard->buckets, 0xFF, bucket_count * sizeof(u32));
+	}
+}
+
+void dircache_terminate(void) {
+	if (!enabled)
+		return;
+
+	for (usz i = 0; i < SHARD_COUNT; ++i) {
+		dircache_shard_t* shard = &shards[i];
+		for (u32 j = 0; j < shard->ent_count; ++j)
+			close(shard->ents[j].fd);
+
+		lt_mfree(alloc, shard->ents);
+		lt_mfree(alloc, shard->buckets);
+		pthread_mutex_destroy(&shard->lock);
+	}
+	enabled = 0;
+}
+
+static
+u64 key_hash(mod_t* mod, usz dir_id) {
+	u64 h = (u64)(usz)mod ^ ((u64)dir_id * 0x9E3779B97F4A7C15);
+	return h ^ (h >> 29);
+}
+
+static
+dircache_shard_t* key_shard(u64 hash) {
+	return &shards[(hash >> 32) % SHARD_COUNT];
+}
+
+static
+void lru_unlink(dircache_shard_t* shard, u32 idx) {
+	dircache_ent_t* ent = &shard->ents[idx];
+	if (ent->lru_prev != NIL)
+		shard->ents[ent->lru_prev].lru_next = ent->lru_next;
+	else
+		shard->lru_head = ent->lru_next;
+	if (ent->lru_next != NIL)
+		shard->ents[ent->lru_next].lru_prev = ent->lru_prev;
+	else
+		shard->lru_tail = ent->lru_prev;
+}
+
+static
+void lru_push_front(dircache_shard_t* shard, u32 idx) {
+	shard->ents[idx].lru_prev = NIL;
+	shard->ents[idx].lru_next = shard->lru_head;
+	if (shard->lru_head != NIL)
+		shard->ents[shard->lru_head].lru_prev = idx;
+	shard->lru_head = idx;
+	if (shard->lru_tail == NIL)
+		shard->lru_tail = idx;
+}
+
+static
+u32* bucket_find(dircache_shard_t* shard, u32 idx) {
+	dircache_ent_t* ent = &shard->ents[idx];
+	u32* it = &shard->buckets[key_hash(ent->mod, ent->dir_id) & shard->bucket_mask];
+	while (*it != idx)
+		it = &shard->ents[*it].hash_next;
+	return it;
+}
+
+static
+int open_dir(mod_t* mod, lstr_t dir_path) {
+	char* cpath = lt_lstos(dir_path, alloc);
+	int fd = openat(mod->rootfd, cpath, O_PATH|O_DIRECTORY);
+	if (fd < 0) {
+		if (errno == ENOENT || errno == ENOTDIR)
+			fd = openat_nocase(mod->rootfd, cpath, O_PATH|O_DIRECTORY, 0);
+		else
+			fd = -errno;
+	}
+	lt_mfree(alloc, cpath);
+	return fd;
+}
+
+// must be called with the shard locked
+static
+int shard_get(dircache_shard_t* shard, u64 hash, mod_t* mod, usz dir_id, lstr_t dir_path) {
+	u32 bucket = hash & shard->bucket_mask;
+	for (u32 idx = shard->buckets[bucket]; idx != NIL; idx = shard->ents[idx].hash_next) {
+		if (shard->ents[idx].mod != mod || shard->ents[idx].dir_id != dir_id)
+			continue;
+
+		++shard->hits;
+		if (idx != shard->lru_head) {
+			lru_unlink(shard, idx);
+			lru_push_front(shard, idx);
+		}
+		return shard->ents[idx].fd;
+	}
+
+	++shard->misses;
+	int fd = open_dir(mod, dir_path);
+	if (fd < 0)
+		return fd;
+
+	u32 idx;
+	if (shard->ent_count < shard->ent_max)
+		idx = shard->ent_count++;
+	else {
+		idx = shard->lru_tail;
+		lru_unlink(shard, idx);
+		u32* link = bucket_find(shard, idx);
+		*link = shard->ents[idx].hash_next;
+		close(shard->ents[idx].fd);
+	}
+
+	shard->ents[idx] = (dircache_ent_t) {
+			.mod = mod,
+			.dir_id = dir_id,
+			.fd = fd,
+			.hash_next = shard->buckets[bucket] };
+	shard->buckets[bucket] = idx;
+	lru_push_front(shard, idx);
+	return fd;
+}
+
+int dircache_openat(mod_t* mod, usz dir_id, lstr_t dir_path, char* name, int flags, mode_t mode) {
+	if (!enabled)
+		return -ENOSYS;
+
+	u64 hash = key_hash(mod, dir_id);
+	dircache_shard_t* shard = key_shard(hash);
+
+	pthread_mutex_lock(&shard->lock);
+	int res = shard_get(shard, hash, mod, dir_id, dir_path);
+	if (res >= 0) {
+		res = openat(res, name, flags, mode);
+		if (res < 0)
+			res = -errno;
+	}
+	pthread_mutex_unlock(&shard->lock);
+	return res;
+}
+
+int dircache_fstatat(mod_t* mod, usz dir_id, lstr_t dir_path, char* name, struct stat* st, int flags) {
+	if (!enabled)
+		return -ENOSYS;
+
+	u64 hash = key_hash(mod, dir_id);
+	dircache_shard_t* shard = key_shard(hash);
+
+	pthread_mutex_lock(&shard->lock);
+	int res = shard_get(shard, hash, mod, dir_id, dir_path);
+	if (res >= 0) {
+		res = fstatat(res, name, st, flags);
+		if (res < 0)
+			res = -errno;
+	}
+	pthread_mutex_unlock(&shard->lock);
+	return res;
+}
+
+void dircache_drop(usz dir_id) {
+	if (!enabled)
+		return;
+
+	for (usz s = 0; s < SHARD_COUNT; ++s) {
+		dircache_shard_t* shard = &shards[s];
+		pthread_mutex_lock(&shard->lock);
+
+		for (u32 i = 0; i < shard->ent_count; ++i) {
+			if (shard->ents[i].dir_id != dir_id)
+				continue;
+
+			lru_unlink(shard, i);
+			u32* link = bucket_find(shard, i);
+			*link = shard->ents[i].hash_next;
+			close(shard->ents[i].fd);
+
+			// move the last entry into the vacated slot to keep the array dense
+			u32 last = --shard->ent_count;
+			if (i == last)
+				break;
+
+			*bucket_find(shard, last) = i;
+			shard->ents[i] = shard->ents[last];
+
+			dircache_ent_t* ent = &shard->ents[i];
+			if (ent->lru_prev != NIL)
+				shard->ents[ent->lru_prev].lru_next = i;
+			else
+				shard->lru_head = i;
+			if (ent->lru_next != NIL)
+				shard->ents[ent->lru_next].lru_prev = i;
+			else
+				shard->lru_tail = i;
+			--i;
+		}
+
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+void dircache_get_stats(usz* out_hits, usz* out_misses, usz* out_count, usz* out_max) {
+	usz hits = 0, misses = 0, count = 0, max = 0;
+	for (usz i = 0; enabled && i < SHARD_COUNT; ++i) {
+		hits += shards[i].hits;
+		misses += shards[i].misses;
+		count += shards[i].ent_count;
+		max += shards[i].ent_max;
+	}
+	*out_hits = hits;
+	*out_misses = misses;
+	*out_count = count;
+	*out_max = max;
+}
+
+void dircache_print_stats(void) {
+	usz hits, misses, count, max;
+	dircache_get_stats(&hits, &misses, &count, &max);
+
+	usz total = hits + misses;
+	usz rate = total ? hits * 100 / total : 0;
+	lt_ierrf("dirfd cache: %uz hits, %uz misses, %uz%c hit rate, %uz/%uz descriptors\n", hits, misses, rate, '%', count, max);
+}
@@ -0,0 +1,21 @@
+#ifndef DIRCACHE_H
+#define DIRCACHE_H 1
+
+#include <lt/fwd.h>
+
+#include <sys/stat.h>
+
+typedef struct mod mod_t;
+
+void dircache_init(usz size);
+void dircache_terminate(void);
+
+int dircache_openat(mod_t* mod, usz dir_id, lstr_t dir_path, char* name, int flags, mode_t mode);
+int dircache_fstatat(mod_t* mod, usz dir_id, lstr_t dir_path, char* name, struct stat* st, int flags);
+void dircache_drop(usz dir_id);
+
+// counters are read without locking, so they may be slightly out of date
+void dircache_get_stats(usz* out_hits, usz* out_misses, usz* out_count, usz* out_max);
+void dircache_print_stats(void);
+
+#endif
@@ -0,0 +1,203 @@
+#include "filecache.h"
+
+#include <lt/mem.h>
+#include <lt/io.h>
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define alloc lt_libc_heap
+
+// LRU cache of the complete contents of small files, keyed on inode.
+// entries are reference counted by the open files reading from them, an entry that is
+// evicted or dropped while still open is only freed once the last of them is released.
+
+#define BUCKET_COUNT 4096
+
+struct filecache_ent {
+	usz id;
+	u32 refs;
+	b8 cached;
+
+	filecache_ent_t* hash_next;
+	filecache_ent_t* lru_prev;
+	filecache_ent_t* lru_next;
+
+	usz size;
+	char data[];
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static filecache_ent_t* buckets[BUCKET_COUNT];
+static filecache_ent_t* lru_head = NULL;
+static filecache_ent_t* lru_tail = NULL;
+static usz capacity = 0;
+static usz used = 0;
+
+static usz hits = 0;
+static usz misses = 0;
+
+void filecache_init(usz capacity_) {
+	capacity = capacity_;
+	used = 0;
+	hits = misses = 0;
+}
+
+static
+filecache_ent_t** bucket_link(usz id) {
+	filecache_ent_t** link = &buckets[id % BUCKET_COUNT];
+	while (*link && (*link)->id != id)
+		link = &(*link)->hash_next;
+	return link;
+}
+
+static
+void lru_unlink(filecache_ent_t* ent) {
+	if (ent->lru_prev)
+		ent->lru_prev->lru_next = ent->lru_next;
+	else
+		lru_head = ent->lru_next;
+	if (ent->lru_next)
+		ent->lru_next->lru_prev = ent->lru_prev;
+	else
+		lru_tail = ent->lru_prev;
+	ent->lru_prev = ent->lru_next = NULL;
+}
+
+static
+void lru_push(filecache_ent_t* ent) {
+	ent->lru_prev = NULL;
+	ent->lru_next = lru_head;
+	if (lru_head)
+		lru_head->lru_prev = ent;
+	else
+		lru_tail = ent;
+	lru_head = ent;
+}
+
+static
+void ent_remove(filecache_ent_t* ent) {
+	*bucket_link(ent->id) = ent->hash_next;
+	lru_unlink(ent);
+	used -= ent->size;
+	ent->cached = 0;
+	if (!ent->refs)
+		lt_mfree(alloc, ent);
+}
+
+void filecache_terminate(void) {
+	pthread_mutex_lock(&lock);
+	while (lru_tail)
+		ent_remove(lru_tail);
+	capacity = 0;
+	pthread_mutex_unlock(&lock);
+}
+
+filecache_ent_t* filecache_get(usz id) {
+	pthread_mutex_lock(&lock);
+	filecache_ent_t* ent = *bucket_link(id);
+	if (ent) {
+		++ent->refs;
+		lru_unlink(ent);
+		lru_push(ent);
+		++hits;
+	}
+	else
+		++misses;
+	pthread_mutex_unlock(&lock);
+	return ent;
+}
+
+filecache_ent_t* filecache_load(usz id, int fd, usz size) {
+	if (size > capacity)
+		return NULL;
+
+	filecache_ent_t* ent = lt_malloc(alloc, sizeof(filecache_ent_t) + size);
+	LT_ASSERT(ent != NULL);
+	*ent = (filecache_ent_t) {
+			.id = id,
+			.refs = 1,
+			.cached = 1 };
+
+	// the file may have shrunk since its size was recorded, only what was read is kept
+	while (ent->size < size) {
+		isz res = pread(fd, ent->data + ent->size, size - ent->size, ent->size);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res < 0) {
+			lt_mfree(alloc, ent);
+			return NULL;
+		}
+		if (res == 0)
+			break;
+		ent->size += res;
+	}
+
+	pthread_mutex_lock(&lock);
+
+	// another thread may have loaded the same file in the meantime
+	filecache_ent_t** link = bucket_link(id);
+	if (*link) {
+		filecache_ent_t* existing = *link;
+		++existing->refs;
+		pthread_mutex_unlock(&lock);
+		lt_mfree(alloc, ent);
+		return existing;
+	}
+
+	while (lru_tail && used + ent->size > capacity)
+		ent_remove(lru_tail);
+
+	*link = ent;
+	lru_push(ent);
+	used += ent->size;
+
+	pthread_mutex_unlock(&lock);
+	return ent;
+}
+
+void filecache_unref(filecache_ent_t* ent) {
+	pthread_mutex_lock(&lock);
+	LT_ASSERT(ent->refs > 0);
+	if (!--ent->refs && !ent->cached)
+		lt_mfree(alloc, ent);
+	pthread_mutex_unlock(&lock);
+}
+
+usz filecache_read(filecache_ent_t* ent, char** out, usz size, u64 off) {
+	if (off >= ent->size) {
+		*out = ent->data;
+		return 0;
+	}
+	*out = ent->data + off;
+	return ent->size - off < size ? ent->size - off : size;
+}
+
+usz filecache_size(filecache_ent_t* ent) {
+	return ent->size;
+}
+
+void filecache_drop(usz id) {
+	pthread_mutex_lock(&lock);
+	filecache_ent_t* ent = *bucket_link(id);
+	if (ent)
+		ent_remove(ent);
+	pthread_mutex_unlock(&lock);
+}
+
+void filecache_get_stats(usz* out_hits, usz* out_misses, usz* out_used, usz* out_capacity) {
+	pthread_mutex_lock(&lock);
+	*out_hits = hits;
+	*out_misses = misses;
+	*out_used = used;
+	*out_capacity = capacity;
+	pthread_mutex_unlock(&lock);
+}
+
+void filecache_print_stats(void) {
+	usz total = hits + misses;
+	usz rate = total ? hits * 100 / total : 0;
+	lt_ierrf("file cache: %uz hits, %uz misses, %uz%c hit rate, %uz/%uz KiB\n", hits, misses, rate, '%', used / 1024, capacity / 1024);
+}
@@ -0,0 +1,25 @@
+#ifndef FILECACHE_H
+#define FILECACHE_H 1
+
+#include <lt/fwd.h>
+
+typedef struct filecache_ent filecache_ent_t;
+
+void filecache_init(usz capacity);
+void filecache_terminate(void);
+
+// returned entries are referenced and must be released with filecache_unref
+filecache_ent_t* filecache_get(usz id);
+filecache_ent_t* filecache_load(usz id, int fd, usz size);
+void filecache_unref(filecache_ent_t* ent);
+
+usz filecache_read(filecache_ent_t* ent, char** out, usz size, u64 off);
+usz filecache_size(filecache_ent_t* ent);
+
+// forget an inode's contents, open files keep reading the data they already have
+void filecache_drop(usz id);
+
+void filecache_get_stats(usz* out_hits, usz* out_misses, usz* out_used, usz* out_capacity);
+void filecache_print_stats(void);
+
+#endif
@@ -1,35 +1,94 @@
+#define _GNU_SOURCE
+
 #include <lt/mem.h>
 
+#include <errno.h>
 #include <unistd.h>
 #include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
 
 #define alloc lt_libc_heap
 
-int copyat(int from_fd, char* from_path, int to_fd, char* to_path) {
-	int infd = openat(from_fd, from_path, O_RDONLY, 0);
-	if (infd < 0)
+static
+b8 copy_unsupported(int err) {
+	return err == EXDEV || err == EINVAL || err == ENOSYS || err == EOPNOTSUPP || err == ETXTBSY;
+}
+
+int write_all(int fd, void* data, usz size) {
+	while (size) {
+		isz res = write(fd, data, size);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		data = (char*)data + res;
+		size -= res;
+	}
+	return 0;
+}
+
+// copy the remaining contents of infd to outfd, trying the fastest method first.
+// reflinks share extents on filesystems such as btrfs and xfs, copy_file_range and sendfile
+// keep the data in the kernel, and a plain read/write loop is used as the last resort.
+// all but cloning advance the file offsets, so a later method resumes where an earlier one failed.
+int copyfd(int infd, int outfd) {
+	if (ioctl(outfd, FICLONE, infd) == 0)
+		return 0;
+
+	isz res;
+	while ((res = copy_file_range(infd, NULL, outfd, NULL, LT_GB(1), 0)) > 0)
+		;
+	if (res == 0)
+		return 0;
+	if (!copy_unsupported(errno))
 		return -1;
 
-	int outfd = openat(to_fd, to_path, O_WRONLY|O_CREAT|O_TRUNC, 0666);
- 	if (outfd < 0)
+	while ((res = sendfile(outfd, infd, NULL, LT_GB(1))) > 0)
+		;
+	if (res == 0)
+		return 0;
+	if (!copy_unsupported(errno))
 		return -1;
 
 	usz copy_bufsz = LT_KB(64);
 	char* copy_buf = lt_malloc(alloc, copy_bufsz);
 
-	isz res;
-	while ((res = read(infd, copy_buf, copy_bufsz))) {
-		if (res < 0)
-			return -1;
-		res = write(outfd, copy_buf, res);
-		if (res < 0)
-			return -1;
+	while ((res = read(infd, copy_buf, copy_bufsz)) > 0) {
+		for (isz written = 0, n; written < res; written += n) {
+			n = write(outfd, copy_buf + written, res - written);
+			if (n < 0) {
+				res = -1;
+				goto done;
+			}
+		}
 	}
 
-	close(infd);
-	close(outfd);
-
+done:
 	lt_mfree(alloc, copy_buf);
 
+	if (res < 0)
+		return -1;
 	return 0;
 }
+
+int copyat(int from_fd, char* from_path, int to_fd, char* to_path) {
+	int infd = openat(from_fd, from_path, O_RDONLY, 0);
+	if (infd < 0)
+		return -1;
+
+	int outfd = openat(to_fd, to_path, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+ 	if (outfd < 0) {
+		close(infd);
+		return -1;
+	}
+
+	int res = copyfd(infd, outfd);
+
+	close(infd);
+	close(outfd);
+
+	return res;
+}
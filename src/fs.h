@@ -1,6 +1,10 @@
 #ifndef FS_H
 #define FS_H 1
 
+#include <lt/fwd.h>
+
+int write_all(int fd, void* data, usz size);
+int copyfd(int infd, int outfd);
 int copyat(int from_fd, char* from_path, int to_fd, char* to_path);
 
 #endif
\ No newline at end of file
@@ -3,6 +3,9 @@
 #include <lt/str.h>
 #include <lt/mem.h>
 
+#include "fs.h"
+#include "nocase.h"
+
 #define alloc lt_libc_heap
 
 #include <errno.h>
@@ -41,7 +44,7 @@ int rebuild_path_case_at(int fd, char* path) {
 
 	struct dirent* ent;
 	while ((ent = readdir(d))) {
-		if (!lt_lseq_nocase(name, lt_lsfroms(ent->d_name)))
+		if (!lseq_nocase(name, lt_lsfroms(ent->d_name)))
 			continue;
 
 	//lt_ierrf("%s: %s\n", path, child_path);
@@ -104,7 +107,7 @@ int openat_nocase(int fd, char* path, int flags, mode_t mode) {
 
 	struct dirent* ent;
 	while ((ent = readdir(d))) {
-		if (!lt_lseq_nocase(name, lt_lsfroms(ent->d_name)))
+		if (!lseq_nocase(name, lt_lsfroms(ent->d_name)))
 			continue;
 
 		if (last) {
@@ -141,7 +144,7 @@ int fstatat_nocase(int fd, char* path, struct stat* st, int flags) {
 
 	struct dirent* ent;
 	while ((ent = readdir(d))) {
-		if (!lt_lseq_nocase(name, lt_lsfroms(ent->d_name)))
+		if (!lseq_nocase(name, lt_lsfroms(ent->d_name)))
 			continue;
 
 		if (last) {
@@ -178,7 +181,7 @@ int unlinkat_nocase(int fd, char* path, int flags) {
 
 	struct dirent* ent;
 	while ((ent = readdir(d))) {
-		if (!lt_lseq_nocase(name, lt_lsfroms(ent->d_name)))
+		if (!lseq_nocase(name, lt_lsfroms(ent->d_name)))
 			continue;
 
 		if (last) {
@@ -223,7 +226,7 @@ int mkdirat_nocase(int fd, char* path, mode_t mode) {
 
 	struct dirent* ent;
 	while ((ent = readdir(d))) {
-		if (!lt_lseq_nocase(name, lt_lsfroms(ent->d_name)))
+		if (!lseq_nocase(name, lt_lsfroms(ent->d_name)))
 			continue;
 
 		if (last) {
@@ -255,23 +258,15 @@ int copyat_nocase(int from_fd, char* from_path, int to_fd, char* to_path) {
 		return infd;
 
 	int outfd = openat_nocase(to_fd, to_path, O_WRONLY|O_CREAT|O_TRUNC, 0666);
- 	if (outfd < 0)
+ 	if (outfd < 0) {
+		close(infd);
 		return outfd;
-
-	usz copy_bufsz = LT_KB(64);
-	char* copy_buf = lt_malloc(alloc, copy_bufsz);
-
-	isz res;
-	while ((res = read(infd, copy_buf, copy_bufsz))) {
-		LT_ASSERT(res >= 0);
-		res = write(outfd, copy_buf, res);
-		LT_ASSERT(res >= 0);
 	}
 
+	int res = copyfd(infd, outfd) < 0 ? -errno : 0;
+
 	close(infd);
 	close(outfd);
 
-	lt_mfree(alloc, copy_buf);
-
-	return 0;
+	return res;
 }
@@ -1,10 +1,14 @@
 #ifndef FS_NOCASE_H
 #define FS_NOCASE_H
 
+#include <lt/fwd.h>
+
 #include <unistd.h>
 #include <sys/stat.h>
 
-int rebuild_path_case_at(char* path);
+#include "nocase.h"
+
+int rebuild_path_case_at(int fd, char* path);
 int rebuild_path_case(char* path);
 int ls_rebuild_path_case(lstr_t path);
 
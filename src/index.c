@@ -0,0 +1,202 @@
+#include "index.h"
+#include "mod.h"
+#include "fs.h"
+
+#include <lt/mem.h>
+#include <lt/str.h>
+#include <lt/io.h>
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define alloc lt_libc_heap
+
+// the index is a snapshot of every mod's scan, laid out so that it can be used in place
+// after mapping it into memory. it is only ever read by the machine that wrote it,
+// so records are stored in native byte order and layout.
+//
+//   header
+//   mod table (mod_count entries)
+//   per mod: name, scan entries (8-byte aligned), name pool
+
+#define INDEX_MAGIC 0x3158444F4D4C // "LMODX1"
+#define INDEX_VERSION 1
+
+typedef
+struct index_hdr {
+	u64 magic;
+	u32 version;
+	u32 ent_size;
+	u32 mod_count;
+	u32 pad;
+} index_hdr_t;
+
+typedef
+struct index_mod {
+	u64 name_off;
+	u64 ents_off;
+	u64 names_off;
+	u64 ent_count;
+	u64 names_size;
+	u32 name_len;
+	u32 pad;
+} index_mod_t;
+
+static
+b8 range_valid(vfs_index_t* index, u64 off, u64 size) {
+	return off <= index->size && size <= index->size - off;
+}
+
+lt_err_t index_load(char* path, vfs_index_t* out) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return errno == ENOENT ? LT_ERR_NOT_FOUND : LT_ERR_UNKNOWN;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(index_hdr_t)) {
+		close(fd);
+		return LT_ERR_INVALID_FORMAT;
+	}
+
+	void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return LT_ERR_UNKNOWN;
+
+	*out = (vfs_index_t) {
+			.map = map,
+			.size = st.st_size };
+
+	index_hdr_t* hdr = map;
+	if (hdr->magic != INDEX_MAGIC || hdr->version != INDEX_VERSION || hdr->ent_size != sizeof(scan_ent_t))
+		goto err_invalid;
+	if (!range_valid(out, sizeof(index_hdr_t), (u64)hdr->mod_count * sizeof(index_mod_t)))
+		goto err_invalid;
+
+	index_mod_t* mods = (index_mod_t*)(hdr + 1);
+	for (usz i = 0; i < hdr->mod_count; ++i) {
+		index_mod_t* mod = &mods[i];
+		if (!range_valid(out, mod->name_off, mod->name_len) ||
+			!range_valid(out, mod->ents_off, mod->ent_count * sizeof(scan_ent_t)) ||
+			!range_valid(out, mod->names_off, mod->names_size) ||
+			mod->ents_off % 8 != 0)
+			goto err_invalid;
+	}
+	return LT_SUCCESS;
+
+err_invalid:
+	index_unload(out);
+	return LT_ERR_INVALID_FORMAT;
+}
+
+void index_unload(vfs_index_t* index) {
+	if (index->map)
+		munmap(index->map, index->size);
+	*index = (vfs_index_t) { 0 };
+}
+
+b8 index_find(vfs_index_t* index, lstr_t mod_name, mod_scan_t* out) {
+	index_hdr_t* hdr = index->map;
+	index_mod_t* mods = (index_mod_t*)(hdr + 1);
+
+	for (usz i = 0; i < hdr->mod_count; ++i) {
+		index_mod_t* mod = &mods[i];
+		lstr_t name = LSTR((char*)index->map + mod->name_off, mod->name_len);
+		if (!lt_lseq(name, mod_name))
+			continue;
+
+		scan_ent_t* ents = (scan_ent_t*)((char*)index->map + mod->ents_off);
+		char* names = (char*)index->map + mod->names_off;
+
+		// reject entries that would point outside of their own scan
+		for (usz j = 0; j < mod->ent_count; ++j) {
+			if ((j != 0 && ents[j].parent >= j) ||
+				(u64)ents[j].name_off + ents[j].name_len > mod->names_size)
+				return 0;
+		}
+		if (mod->ent_count == 0 || ents[0].parent != SCAN_NO_PARENT)
+			return 0;
+
+		*out = (mod_scan_t) {
+				.ents = ents,
+				.ent_count = mod->ent_count,
+				.names = names,
+				.names_size = mod->names_size,
+				.owned = 0,
+				.indexed = 1 };
+		return 1;
+	}
+	return 0;
+}
+
+#define ALIGN8(x) (((x) + 7) & ~(u64)7)
+
+lt_err_t index_write(char* path, mod_t** mods, mod_scan_t* scans, usz count) {
+	usz table_size = sizeof(index_hdr_t) + count * sizeof(index_mod_t);
+	index_mod_t* table = lt_malloc(alloc, count * sizeof(index_mod_t));
+	LT_ASSERT(table != NULL);
+
+	u64 off = table_size;
+	for (usz i = 0; i < count; ++i) {
+		table[i] = (index_mod_t) {
+				.name_off = off,
+				.name_len = mods[i]->name.len,
+				.ent_count = scans[i].ent_count,
+				.names_size = scans[i].names_size };
+		off = ALIGN8(off + mods[i]->name.len);
+		table[i].ents_off = off;
+		off += scans[i].ent_count * sizeof(scan_ent_t);
+		table[i].names_off = off;
+		off += scans[i].names_size;
+	}
+
+	index_hdr_t hdr = {
+			.magic = INDEX_MAGIC,
+			.version = INDEX_VERSION,
+			.ent_size = sizeof(scan_ent_t),
+			.mod_count = count };
+
+	// write to a temporary file first, so that a crash never leaves a truncated index behind
+	char* tmp_path = lt_lsbuild(alloc, "%s.tmp%c", path, 0).str;
+	int fd = open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd < 0)
+		goto err0;
+
+	if (write_all(fd, &hdr, sizeof(hdr)) < 0 || write_all(fd, table, count * sizeof(index_mod_t)) < 0)
+		goto err1;
+
+	static u8 zero[8];
+	off = table_size;
+	for (usz i = 0; i < count; ++i) {
+		if (write_all(fd, mods[i]->name.str, mods[i]->name.len) < 0)
+			goto err1;
+		off += mods[i]->name.len;
+		if (write_all(fd, zero, table[i].ents_off - off) < 0)
+			goto err1;
+		if (write_all(fd, scans[i].ents, scans[i].ent_count * sizeof(scan_ent_t)) < 0)
+			goto err1;
+		if (write_all(fd, scans[i].names, scans[i].names_size) < 0)
+			goto err1;
+		off = table[i].names_off + scans[i].names_size;
+	}
+
+	if (close(fd) < 0)
+		goto err0;
+	if (rename(tmp_path, path) < 0)
+		goto err0;
+
+	lt_mfree(alloc, tmp_path);
+	lt_mfree(alloc, table);
+	return LT_SUCCESS;
+
+err1:	close(fd);
+err0:	unlink(tmp_path);
+		lt_mfree(alloc, tmp_path);
+		lt_mfree(alloc, table);
+		return LT_ERR_UNKNOWN;
+}
@@ -0,0 +1,22 @@
+#ifndef INDEX_H
+#define INDEX_H 1
+
+#include <lt/fwd.h>
+#include <lt/err.h>
+
+#include "scan.h"
+
+typedef
+struct vfs_index {
+	void* map;
+	usz size;
+} vfs_index_t;
+
+lt_err_t index_load(char* path, vfs_index_t* out);
+void index_unload(vfs_index_t* index);
+
+b8 index_find(vfs_index_t* index, lstr_t mod_name, mod_scan_t* out);
+
+lt_err_t index_write(char* path, mod_t** mods, mod_scan_t* scans, usz count);
+
+#endif
@@ -0,0 +1,243 @@
+#include "lazycopy.h"
+
+#include <lt/mem.h>
+#include <lt/io.h>
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define alloc lt_libc_heap
+
+// sparse copy-on-write of a file being redirected to the output directory.
+// the output file starts out as a sparse file of the original size, and a bitmap tracks
+// which blocks have been written to it. reads of any other block go to the original file,
+// and blocks are only copied when a write covers them partially.
+// the remaining blocks are copied once the last descriptor using the file is released,
+// until then the original file stays open and missing blocks keep being read from it.
+
+#define BLOCK_SHIFT 16
+#define BLOCK_SIZE (1 << BLOCK_SHIFT)
+
+struct lazy_file {
+	pthread_mutex_t lock;
+	u32 refs;
+
+	int lower_fd;
+	int upper_fd;
+	u64 lower_size;
+
+	u64* bitmap;
+	u64 block_count;
+};
+
+lazy_file_t* lazy_create(int lower_fd, int upper_fd, u64 size) {
+	if (ftruncate(upper_fd, size) < 0)
+		return NULL;
+
+	lazy_file_t* lazy = lt_malloc(alloc, sizeof(lazy_file_t));
+	LT_ASSERT(lazy != NULL);
+
+	u64 block_count = (size + BLOCK_SIZE - 1) >> BLOCK_SHIFT;
+	usz bitmap_size = ((block_count + 63) / 64) * sizeof(u64);
+
+	*lazy = (lazy_file_t) {
+			.lower_fd = lower_fd,
+			.upper_fd = upper_fd,
+			.lower_size = size,
+			.block_count = block_count };
+	pthread_mutex_init(&lazy->lock, NULL);
+
+	lazy->bitmap = lt_malloc(alloc, bitmap_size ? bitmap_size : sizeof(u64));
+	LT_ASSERT(lazy->bitmap != NULL);
+	memset(lazy->bitmap, 0, bitmap_size);
+	return lazy;
+}
+
+void lazy_ref(lazy_file_t* lazy) {
+	__atomic_fetch_add(&lazy->refs, 1, __ATOMIC_RELAXED);
+}
+
+b8 lazy_unref(lazy_file_t* lazy) {
+	return __atomic_sub_fetch(&lazy->refs, 1, __ATOMIC_ACQ_REL) == 0;
+}
+
+b8 lazy_unused(lazy_file_t* lazy) {
+	return __atomic_load_n(&lazy->refs, __ATOMIC_ACQUIRE) == 0;
+}
+
+static
+b8 block_present(lazy_file_t* lazy, u64 blk) {
+	if (blk >= lazy->block_count)
+		return 1;
+	return (__atomic_load_n(&lazy->bitmap[blk / 64], __ATOMIC_ACQUIRE) >> (blk % 64)) & 1;
+}
+
+static
+void block_mark(lazy_file_t* lazy, u64 blk) {
+	if (blk < lazy->block_count)
+		__atomic_fetch_or(&lazy->bitmap[blk / 64], (u64)1 << (blk % 64), __ATOMIC_RELEASE);
+}
+
+static
+isz pread_full(int fd, char* buf, usz size, u64 off) {
+	usz total = 0;
+	while (total < size) {
+		isz res = pread(fd, buf + total, size - total, off + total);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (res == 0)
+			break;
+		total += res;
+	}
+	return total;
+}
+
+static
+isz pwrite_full(int fd, char* buf, usz size, u64 off) {
+	usz total = 0;
+	while (total < size) {
+		isz res = pwrite(fd, buf + total, size - total, off + total);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		total += res;
+	}
+	return total;
+}
+
+// must be called with the file locked
+static
+int block_materialize(lazy_file_t* lazy, u64 blk, char* buf) {
+	if (block_present(lazy, blk))
+		return 0;
+
+	u64 start = blk << BLOCK_SHIFT;
+	if (start < lazy->lower_size) {
+		u64 size = lazy->lower_size - start;
+		if (size > BLOCK_SIZE)
+			size = BLOCK_SIZE;
+
+		isz res = pread_full(lazy->lower_fd, buf, size, start);
+		if (res < 0 || pwrite_full(lazy->upper_fd, buf, res, start) < 0)
+			return -errno;
+	}
+
+	block_mark(lazy, blk);
+	return 0;
+}
+
+isz lazy_read(lazy_file_t* lazy, void* buf, usz size, u64 off) {
+	u64 end = off + size;
+	u64 pos = off;
+
+	while (pos < end) {
+		u64 blk = pos >> BLOCK_SHIFT;
+		u64 seg_end = (blk + 1) << BLOCK_SHIFT;
+		if (seg_end > end)
+			seg_end = end;
+
+		int fd = lazy->upper_fd;
+		u64 lower_size = __atomic_load_n(&lazy->lower_size, __ATOMIC_ACQUIRE);
+		if (!block_present(lazy, blk) && pos < lower_size) {
+			fd = lazy->lower_fd;
+			if (seg_end > lower_size)
+				seg_end = lower_size;
+		}
+
+		u64 want = seg_end - pos;
+		isz res = pread_full(fd, (char*)buf + (pos - off), want, pos);
+		if (res < 0)
+			return -errno;
+		pos += res;
+		if (res < want)
+			break;
+	}
+
+	return pos - off;
+}
+
+isz lazy_write(lazy_file_t* lazy, void* buf, usz size, u64 off) {
+	if (size == 0)
+		return 0;
+
+	u64 end = off + size;
+	u64 first = off >> BLOCK_SHIFT;
+	u64 last = (end - 1) >> BLOCK_SHIFT;
+
+	pthread_mutex_lock(&lazy->lock);
+
+	// only blocks that are partially overwritten need their old contents
+	char* block_buf = NULL;
+	int err = 0;
+	if ((off & (BLOCK_SIZE - 1)) || (first == last && (end & (BLOCK_SIZE - 1)))) {
+		block_buf = lt_malloc(alloc, BLOCK_SIZE);
+		err = block_materialize(lazy, first, block_buf);
+	}
+	if (!err && last != first && (end & (BLOCK_SIZE - 1))) {
+		if (!block_buf)
+			block_buf = lt_malloc(alloc, BLOCK_SIZE);
+		err = block_materialize(lazy, last, block_buf);
+	}
+	lt_mfree(alloc, block_buf);
+
+	isz res = err;
+	if (!err) {
+		res = pwrite_full(lazy->upper_fd, buf, size, off);
+		if (res < 0)
+			res = -errno;
+		else {
+			for (u64 blk = first; blk <= last; ++blk)
+				block_mark(lazy, blk);
+		}
+	}
+
+	pthread_mutex_unlock(&lazy->lock);
+	return res;
+}
+
+int lazy_truncate(lazy_file_t* lazy, u64 size) {
+	pthread_mutex_lock(&lazy->lock);
+
+	int res = ftruncate(lazy->upper_fd, size);
+	if (res < 0)
+		res = -errno;
+	// anything past the new size must read back as zeroes from now on
+	else if (size < lazy->lower_size)
+		__atomic_store_n(&lazy->lower_size, size, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&lazy->lock);
+	return res;
+}
+
+int lazy_fill(lazy_file_t* lazy) {
+	char* block_buf = lt_malloc(alloc, BLOCK_SIZE);
+	LT_ASSERT(block_buf != NULL);
+
+	// the lock is taken per block, so that writes are never held up for long
+	int res = 0;
+	for (u64 blk = 0; blk < lazy->block_count && !res; ++blk) {
+		if (block_present(lazy, blk))
+			continue;
+		pthread_mutex_lock(&lazy->lock);
+		res = block_materialize(lazy, blk, block_buf);
+		pthread_mutex_unlock(&lazy->lock);
+	}
+
+	lt_mfree(alloc, block_buf);
+	return res;
+}
+
+void lazy_free(lazy_file_t* lazy) {
+	close(lazy->lower_fd);
+	close(lazy->upper_fd);
+	pthread_mutex_destroy(&lazy->lock);
+	lt_mfree(alloc, lazy->bitmap);
+	lt_mfree(alloc, lazy);
+}
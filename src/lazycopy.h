@@ -0,0 +1,23 @@
+#ifndef LAZYCOPY_H
+#define LAZYCOPY_H 1
+
+#include <lt/fwd.h>
+
+typedef struct lazy_file lazy_file_t;
+
+lazy_file_t* lazy_create(int lower_fd, int upper_fd, u64 size);
+void lazy_free(lazy_file_t* lazy);
+
+// copy every block that was not written yet, while the file may still be read and written.
+// returns 0 once the output file is complete.
+int lazy_fill(lazy_file_t* lazy);
+
+void lazy_ref(lazy_file_t* lazy);
+b8 lazy_unref(lazy_file_t* lazy);
+b8 lazy_unused(lazy_file_t* lazy);
+
+isz lazy_read(lazy_file_t* lazy, void* buf, usz size, u64 off);
+isz lazy_write(lazy_file_t* lazy, void* buf, usz size, u64 off);
+int lazy_truncate(lazy_file_t* lazy, u64 size);
+
+#endif
@@ -10,15 +10,19 @@
 #include <lt/ansi.h>
 
 #include <unistd.h>
+#include <stdlib.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <string.h>
 #include <libgen.h>
+#include <errno.h>
+#include <poll.h>
 
 #include "vfs.h"
 #include "fs.h"
 #include "mod.h"
 #include "fomod.h"
+#include "control.h"
 
 #define alloc lt_libc_heap
 
@@ -125,44 +129,143 @@ void copy_profile_configs(lstr_t profile_path, lt_conf_t* cf) {
 	if (copy == NULL)
 		return;
 
-	usz copy_bufsz = LT_KB(64);
-	char* copy_buf = lt_malloc(alloc, copy_bufsz);
-
 	for (usz i = 0; i < copy->child_count; ++i) {
 		lt_conf_t* link = &copy->children[i];
 		if (link->stype != LT_CONF_OBJECT)
 			continue;
 
-		lstr_t from = lt_conf_str(link, CLSTR("from"));
-		from = lt_lsbuild(alloc, "%S/%S", profile_path, from);
-
-		lstr_t to = lt_conf_str(link, CLSTR("to"));
+		char* from = lt_lsbuild(alloc, "%S/%S%c", profile_path, lt_conf_str(link, CLSTR("from")), 0).str;
+		char* to = lt_lstos(lt_conf_str(link, CLSTR("to")), alloc);
 
-		lt_file_t* inf = lt_fopenp(from, LT_FILE_R, 0, alloc);
-		if (inf == NULL) {
-			lt_werrf("failed to copy from '%S': %s\n", from, lt_os_err_str());
-			continue;
+		int infd = open(from, O_RDONLY);
+		if (infd < 0) {
+			lt_werrf("failed to copy from '%s': %s\n", from, lt_os_err_str());
+			goto next;
 		}
 
-		lt_file_t* outf = lt_fopenp(to, LT_FILE_W, 0, alloc);
-		if (outf == NULL) {
-			lt_werrf("failed to copy to '%S': %s\n", to, lt_os_err_str());
-			continue;
+		int outfd = open(to, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+		if (outfd < 0) {
+			lt_werrf("failed to copy to '%s': %s\n", to, lt_os_err_str());
+			close(infd);
+			goto next;
 		}
 
-		isz res;
-		while ((res = lt_fread(inf, copy_buf, copy_bufsz))) {
-			LT_ASSERT(res > 0);
-			res = lt_fwrite(outf, copy_buf, res);
-			LT_ASSERT(res > 0);
-		}
+		if (copyfd(infd, outfd) < 0)
+			lt_werrf("failed to copy '%s' to '%s': %s\n", from, to, lt_os_err_str());
+
+		close(infd);
+		close(outfd);
+
+	next:
+		lt_mfree(alloc, from);
+		lt_mfree(alloc, to);
+	}
+}
+
+void load_vfs_config(lt_conf_t* cf, char* profile_path) {
+	i64 val;
+	if (lt_conf_find_int(cf, CLSTR("dirfd_cache_size"), &val)) {
+		if (val < 0)
+			lt_ferrf("'dirfd_cache_size' cannot be negative\n");
+		vfs_config.dirfd_cache_size = val;
+	}
+	if (lt_conf_find_int(cf, CLSTR("threads"), &val)) {
+		if (val < 1)
+			lt_ferrf("'threads' must be at least 1\n");
+		vfs_config.threads = val;
+	}
+	if (lt_conf_find_int(cf, CLSTR("scan_threads"), &val)) {
+		if (val < 0)
+			lt_ferrf("'scan_threads' cannot be negative\n");
+		vfs_config.scan_threads = val;
+	}
 
-		lt_mfree(alloc, from.str);
-		lt_fclose(inf, alloc);
-		lt_fclose(outf, alloc);
+	if (lt_conf_find_int(cf, CLSTR("negative_timeout"), &val)) {
+		if (val < 0)
+			lt_ferrf("'negative_timeout' cannot be negative\n");
+		vfs_config.negative_timeout = val;
+	}
+	if (lt_conf_find_int(cf, CLSTR("lazy_copy_size"), &val)) {
+		if (val < 0)
+			lt_ferrf("'lazy_copy_size' cannot be negative\n");
+		vfs_config.lazy_copy_size = val;
+	}
+	if (lt_conf_find_int(cf, CLSTR("file_cache_size"), &val)) {
+		if (val < 0)
+			lt_ferrf("'file_cache_size' cannot be negative\n");
+		vfs_config.file_cache_size = val;
+	}
+	if (lt_conf_find_int(cf, CLSTR("file_cache_max"), &val)) {
+		if (val < 0)
+			lt_ferrf("'file_cache_max' cannot be negative\n");
+		vfs_config.file_cache_max = val;
+	}
+	if (lt_conf_find_int(cf, CLSTR("shared_fd_max"), &val)) {
+		if (val < 0)
+			lt_ferrf("'shared_fd_max' cannot be negative\n");
+		vfs_config.shared_fd_max = val;
+	}
+	if (lt_conf_find_int(cf, CLSTR("mod_cache_timeout"), &val)) {
+		if (val < 0)
+			lt_ferrf("'mod_cache_timeout' cannot be negative\n");
+		vfs_config.mod_cache_timeout = val;
+	}
+	if (lt_conf_find_int(cf, CLSTR("output_cache_timeout"), &val)) {
+		if (val < 0)
+			lt_ferrf("'output_cache_timeout' cannot be negative\n");
+		vfs_config.output_cache_timeout = val;
+	}
+	if (lt_conf_find_int(cf, CLSTR("max_read"), &val)) {
+		if (val < 0)
+			lt_ferrf("'max_read' cannot be negative\n");
+		vfs_config.max_read = val;
+	}
+	if (lt_conf_find_int(cf, CLSTR("max_write"), &val)) {
+		if (val < 0)
+			lt_ferrf("'max_write' cannot be negative\n");
+		vfs_config.max_write = val;
+	}
+	if (lt_conf_find_int(cf, CLSTR("max_readahead"), &val)) {
+		if (val < 0)
+			lt_ferrf("'max_readahead' cannot be negative\n");
+		vfs_config.max_readahead = val;
+	}
+	if (lt_conf_find_int(cf, CLSTR("max_background"), &val)) {
+		if (val < 0)
+			lt_ferrf("'max_background' cannot be negative\n");
+		vfs_config.max_background = val;
 	}
+	if (lt_conf_find_int(cf, CLSTR("congestion_threshold"), &val)) {
+		if (val < 0)
+			lt_ferrf("'congestion_threshold' cannot be negative\n");
+		vfs_config.congestion_threshold = val;
+	}
+	if (lt_conf_find_int(cf, CLSTR("boot_trace_time"), &val)) {
+		if (val < 0)
+			lt_ferrf("'boot_trace_time' cannot be negative\n");
+		vfs_config.trace_time = val;
+	}
+
+	b8 flag;
+	if (lt_conf_find_bool(cf, CLSTR("passthrough"), &flag))
+		vfs_config.passthrough = flag;
+
+	if (lt_conf_find_bool(cf, CLSTR("keep_cache"), &flag))
+		vfs_config.keep_cache = flag;
+	if (lt_conf_find_bool(cf, CLSTR("writeback_cache"), &flag))
+		vfs_config.writeback_cache = flag;
+
+	if (lt_conf_find_bool(cf, CLSTR("lazy_dirs"), &flag))
+		vfs_config.lazy_dirs = flag;
+
+	if (lt_conf_find_bool(cf, CLSTR("op_stats"), &flag))
+		vfs_config.op_stats = flag;
 
-	lt_mfree(alloc, copy_buf);
+	if (!lt_conf_find_bool(cf, CLSTR("index"), &flag) || flag)
+		vfs_config.index_path = lt_lsbuild(alloc, "%s/vfs.index%c", profile_path, 0).str;
+
+	if (lt_conf_find_bool(cf, CLSTR("boot_trace"), &flag) && flag)
+		vfs_config.trace_path = lt_lsbuild(alloc, "%s/boot.trace%c", profile_path, 0).str;
 }
 
 #define LIST_LOADORDER 0
@@ -302,6 +405,78 @@ b8 dir_mounted(char* path) {
 	return 0;
 }
 
+// run a command in the mounted vfs, returns the reply without its status line
+b8 request_mounted(char* sock_path, lstr_t cmd, lstr_t* out_body) {
+	lstr_t reply;
+	lt_err_t err = control_request(sock_path, cmd, &reply);
+	if (err == LT_ERR_NOT_FOUND)
+		lt_ferrf("no vfs is listening on '%s', rerun with '--force' to edit the profile anyway\n", sock_path);
+	if (err != LT_SUCCESS)
+		lt_ferrf("failed to reach the mounted vfs: %S\n", lt_err_str(err));
+
+	b8 ok = lt_lsprefix(reply, CLSTR("ok\n"));
+	if (!ok && !lt_lsprefix(reply, CLSTR("error\n"))) {
+		lt_mfree(alloc, reply.str);
+		lt_ferrf("unexpected reply from the mounted vfs\n");
+	}
+
+	usz status_len = ok ? 3 : 6;
+	*out_body = lt_strdup(alloc, LSTR(reply.str + status_len, reply.len - status_len));
+	lt_mfree(alloc, reply.str);
+	return ok;
+}
+
+// apply a load order change to the mounted vfs before the profile is updated to match
+b8 apply_live(char* sock_path, lstr_t cmd) {
+	lstr_t body;
+	b8 ok = request_mounted(sock_path, cmd, &body);
+	lt_mfree(alloc, cmd.str);
+	if (!ok)
+		lt_werrf("%S", body);
+	lt_mfree(alloc, body.str);
+	return ok;
+}
+
+// fork into the background. the parent exits once the child reports through the returned
+// descriptor that the vfs is mounted, or with an error if the child exited before that.
+int daemonize(char* log_path) {
+	int fds[2];
+	if (pipe(fds) < 0)
+		lt_ferrf("failed to create pipe: %s\n", lt_os_err_str());
+
+	pid_t pid = fork();
+	if (pid < 0)
+		lt_ferrf("failed to fork: %s\n", lt_os_err_str());
+
+	if (pid > 0) {
+		close(fds[1]);
+		char c;
+		isz res;
+		while ((res = read(fds[0], &c, 1)) < 0 && errno == EINTR)
+			;
+		if (res != 1)
+			lt_ferrf("failed to mount vfs, see '%s'\n", log_path);
+		lt_printf("vfs mounted in the background (pid %id), stop it with 'lmodorg unmount'.\n", pid);
+		exit(0);
+	}
+
+	close(fds[0]);
+	setsid();
+
+	int null_fd = open("/dev/null", O_RDWR);
+	int log_fd = open(log_path, O_WRONLY|O_CREAT|O_APPEND, 0644);
+	if (null_fd >= 0) {
+		dup2(null_fd, STDIN_FILENO);
+		dup2(log_fd >= 0 ? log_fd : null_fd, STDOUT_FILENO);
+		dup2(log_fd >= 0 ? log_fd : null_fd, STDERR_FILENO);
+		close(null_fd);
+	}
+	if (log_fd >= 0)
+		close(log_fd);
+
+	return fds[1];
+}
+
 lt_err_t install_root(lstr_t in_path, lstr_t out_path) {
 	lt_err_t err;
 
@@ -434,6 +609,7 @@ int main(int argc, char** argv) {
 
 	b8 help = 0;
 	b8 force = 0;
+	b8 daemon_mode = 0;
 
 	char* profile_path = ".";
 
@@ -463,6 +639,16 @@ int main(int argc, char** argv) {
 			continue;
 		}
 
+		if (lt_arg_flag(arg, 'd', CLSTR("daemon"))) {
+			daemon_mode = 1;
+			continue;
+		}
+
+		if (lt_arg_flag(arg, 0, CLSTR("rescan"))) {
+			vfs_config.rescan = 1;
+			continue;
+		}
+
 		lt_darr_push(args, *arg->it);
 	}
 
@@ -474,13 +660,20 @@ int main(int argc, char** argv) {
 			"  -v, --verbose         Print debugging information to stderr.\n"
 			"  -c, --color           Display output in multiple colors.\n"
 			"  -C, --profile=PATH    Use profile at PATH.\n"
+			"  -d, --daemon          Keep the VFS mounted in the background.\n"
+			"      --rescan          Ignore the VFS index and rescan all mods.\n"
 			"commands:\n"
 			"  lmodorg mount [OUTPUT]     Mount VFS with output directory OUTPUT, if no\n"
 			"                             OUTPUT is provided, OUTPUT is PROFILE/output.\n"
 			"  lmodorg new NAMES...       Create and enable empty mods NAMES.\n"
 			"  lmodorg remove NAMES...    Permanently delete mods NAMES.\n"
-			"  lmodorg enable NAMES...    Enable mods NAMES.\n"
-			"  lmodorg disable NAMES...   Disable mods NAMES.\n"
+			"  lmodorg enable NAMES...    Enable mods NAMES, also in a mounted VFS.\n"
+			"  lmodorg disable NAMES...   Disable mods NAMES, also in a mounted VFS.\n"
+			"  lmodorg move NAME POS      Move mod NAME to position POS in the load order.\n"
+			"  lmodorg reload             Apply the mods listed in the profile to a mounted VFS.\n"
+			"  lmodorg unmount            Unmount a VFS that was mounted in the background.\n"
+			"  lmodorg status             Show the state and load order of a mounted VFS.\n"
+			"  lmodorg stats              Show cache statistics of a mounted VFS.\n"
 			"  lmodorg install NAME PATH  Install the archive at PATH.\n"
 			"  lmodorg mods               List installed mods.\n"
 			"  lmodorg active             List active mods.\n"
@@ -504,9 +697,12 @@ int main(int argc, char** argv) {
 
 	lt_conf_t* mods_cf = lt_conf_array(&cf, CLSTR("mods"));
 
+	load_vfs_config(&cf, profile_path);
+
 	char* root_path = lt_lstos(lt_conf_str(&cf, CLSTR("game_root")), alloc);
 	char* mods_path = lt_lsbuild(alloc, "%s/mods%c", profile_path, 0).str;
 	char* output_path = lt_lsbuild(alloc, "%s/output%c", profile_path, 0).str;
+	char* sock_path = lt_lsbuild(alloc, "%s/vfs.sock%c", profile_path, 0).str;
 
 	mods_init();
 
@@ -533,15 +729,38 @@ int main(int argc, char** argv) {
 
 		copy_profile_configs(lt_lsfroms(profile_path), &cf);
 
+		int ready_fd = -1;
+		if (daemon_mode) {
+			char* log_path = lt_lsbuild(alloc, "%s/lmodorg.log%c", profile_path, 0).str;
+			ready_fd = daemonize(log_path);
+			lt_mfree(alloc, log_path);
+		}
+
 		vfs_mount(argv[0], root_path, mods, output_path);
+		if (control_start(sock_path, mods_path, conf_path) != LT_SUCCESS && daemon_mode)
+			lt_ferrf("a vfs in the background cannot be unmounted without its control socket\n");
 
-		lt_term_init(0);
-		lt_printf("vfs mounted, press ctrl+d to quit.\n");
+		// the session also ends when libfuse catches a termination signal
+		if (daemon_mode) {
+			write_all(ready_fd, "1", 1);
+			close(ready_fd);
 
-		while (lt_term_getkey() != (LT_TERM_MOD_CTRL|'D'))
-			;
-		lt_term_restore();
+			while (!control_wait_unmount(1000) && !vfs_exited())
+				;
+		}
+		else {
+			lt_term_init(0);
+			lt_printf("vfs mounted, press ctrl+d to quit.\n");
 
+			while (!control_wait_unmount(0) && !vfs_exited()) {
+				struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+				if (poll(&pfd, 1, 250) > 0 && lt_term_getkey() == (LT_TERM_MOD_CTRL|'D'))
+					break;
+			}
+			lt_term_restore();
+		}
+
+		control_stop();
 		vfs_unmount();
 	}
 
@@ -611,9 +830,7 @@ int main(int argc, char** argv) {
 	}
 
 	else if (strcmp(args[0], "enable") == 0) {
-		if (dir_mounted(root_path) && !force) {
-			lt_ferrf("profiles should not be edited while mounted, rerun with '--force' to try anyway\n");
-		}
+		b8 live = dir_mounted(root_path) && !force;
 
 		if (lt_darr_count(args) < 2) {
 			lt_ferrf("expected a name after 'enable'\n");
@@ -631,6 +848,8 @@ int main(int argc, char** argv) {
 					lt_werrf("mod '%S' is already enabled, skipping...\n", arg);
 				continue;
 			}
+			if (live && !apply_live(sock_path, lt_lsbuild(alloc, "enable 0 %S", arg)))
+				continue;
 
 			lt_conf_t new_conf = {
 					.stype = LT_CONF_STRING,
@@ -642,20 +861,78 @@ int main(int argc, char** argv) {
 	}
 
 	else if (strcmp(args[0], "disable") == 0) {
-		if (dir_mounted(root_path) && !force) {
-			lt_ferrf("profiles should not be edited while mounted, rerun with '--force' to try anyway\n");
-		}
+		b8 live = dir_mounted(root_path) && !force;
 
 		if (lt_darr_count(args) < 2) {
 			lt_ferrf("expected a name after 'disable'\n");
 		}
 
-		for (usz i = 1; i < lt_darr_count(args); ++i)
-			lt_conf_erase_str(mods_cf, lt_lsfroms(args[i]), alloc);
+		for (usz i = 1; i < lt_darr_count(args); ++i) {
+			lstr_t arg = lt_lsfroms(args[i]);
+
+			if (live && mod_enabled(modlist, arg) && !apply_live(sock_path, lt_lsbuild(alloc, "disable %S", arg)))
+				continue;
+			lt_conf_erase_str(mods_cf, arg, alloc);
+		}
+
+		update_config(conf_path, &cf);
+	}
+
+	else if (strcmp(args[0], "move") == 0) {
+		b8 live = dir_mounted(root_path) && !force;
+
+		if (lt_darr_count(args) != 3) {
+			lt_ferrf("command 'move' takes a name and a position\n");
+		}
+
+		lstr_t name = lt_lsfroms(args[1]);
+		if (!mod_enabled(modlist, name)) {
+			lt_ferrf("mod '%S' is not enabled\n", name);
+		}
+
+		char* end;
+		usz pos = strtoul(args[2], &end, 10);
+		if (end == args[2] || *end || pos < 1 || pos > lt_darr_count(modlist)) {
+			lt_ferrf("invalid position '%s', expected a number from 1 to %uz\n", args[2], lt_darr_count(modlist));
+		}
+
+		// the mod takes the place of the one currently at pos, which may be preceded by non-mod entries
+		usz from = 0, to = 0;
+		for (usz i = 0; i < mods_cf->child_count; ++i) {
+			lt_conf_t* mod_cf = &mods_cf->children[i];
+			if (mod_cf->stype != LT_CONF_STRING)
+				continue;
+			if (lt_lseq(mod_cf->str_val, name))
+				from = i;
+			if (lt_lseq(mod_cf->str_val, modlist[pos - 1]))
+				to = i;
+		}
+
+		if (live && !apply_live(sock_path, lt_lsbuild(alloc, "move %uz %S", pos, name)))
+			lt_ferrf("load order was not changed\n");
+
+		lt_conf_t moved = mods_cf->children[from];
+		if (from < to)
+			memmove(&mods_cf->children[from], &mods_cf->children[from + 1], (to - from) * sizeof(lt_conf_t));
+		else
+			memmove(&mods_cf->children[to + 1], &mods_cf->children[to], (from - to) * sizeof(lt_conf_t));
+		mods_cf->children[to] = moved;
 
 		update_config(conf_path, &cf);
 	}
 
+	else if (strcmp(args[0], "reload") == 0 || strcmp(args[0], "unmount") == 0 || strcmp(args[0], "status") == 0 || strcmp(args[0], "stats") == 0) {
+		if (lt_darr_count(args) != 1) {
+			lt_ferrf("command '%s' takes no arguments\n", args[0]);
+		}
+
+		lstr_t body;
+		if (!request_mounted(sock_path, lt_lsfroms(args[0]), &body))
+			lt_ferrf("%S", body);
+		lt_printf("%S", body);
+		lt_mfree(alloc, body.str);
+	}
+
 	else if (strcmp(args[0], "mods") == 0) {
 		if (lt_darr_count(args) != 1) {
 			lt_ferrf("command 'mods' takes no arguments\n");
@@ -854,6 +1131,7 @@ int main(int argc, char** argv) {
 	lt_darr_destroy(avail_mods);
 	lt_darr_destroy(mods);
 
+	lt_mfree(alloc, sock_path);
 	lt_mfree(alloc, output_path);
 	lt_mfree(alloc, mods_path);
 	lt_mfree(alloc, root_path);
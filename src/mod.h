@@ -7,6 +7,10 @@ typedef
 struct mod {
 	lstr_t name;
 	int rootfd;
+
+	// bytes served from and written to the mod while mounted
+	u64 bytes_read;
+	u64 bytes_written;
 } mod_t;
 
 void mods_init(void);
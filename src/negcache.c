@@ -0,0 +1,142 @@
+#include "negcache.h"
+#include "notify.h"
+#include "fs_nocase.h"
+
+#include <lt/mem.h>
+#include <lt/str.h>
+#include <lt/io.h>
+
+#include <string.h>
+#include <pthread.h>
+
+#define alloc lt_libc_heap
+
+// names that the kernel was told do not exist. lookups ignore case, so creating a file
+// has to invalidate every spelling of its name that the kernel may have cached as missing.
+// once the table fills up every recorded name is invalidated and the table starts over.
+
+#define NIL ((u32)-1)
+
+#define NEGCACHE_MAX 65536
+#define BUCKET_COUNT NEGCACHE_MAX
+
+typedef
+struct negcache_ent {
+	usz parent_id;
+	u32 hash;
+	u32 next;
+	lstr_t name;
+} negcache_ent_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static negcache_ent_t* ents = NULL;
+static u32* buckets = NULL;
+static u32 ent_free = NIL;
+static u32 ent_count = 0;
+
+static
+u32 key_bucket(usz parent_id, u32 hash) {
+	return (hash ^ (u32)(parent_id * 0x9E3779B1)) % BUCKET_COUNT;
+}
+
+static
+void reset(void) {
+	for (u32 i = 0; i < NEGCACHE_MAX; ++i)
+		ents[i].next = i + 1 < NEGCACHE_MAX ? i + 1 : NIL;
+	memset(buckets, 0xFF, BUCKET_COUNT * sizeof(u32));
+	ent_free = 0;
+	ent_count = 0;
+}
+
+void negcache_init(void) {
+	ents = lt_malloc(alloc, NEGCACHE_MAX * sizeof(negcache_ent_t));
+	LT_ASSERT(ents != NULL);
+	buckets = lt_malloc(alloc, BUCKET_COUNT * sizeof(u32));
+	LT_ASSERT(buckets != NULL);
+	reset();
+}
+
+static
+void free_names(b8 invalidate) {
+	for (u32 b = 0; b < BUCKET_COUNT; ++b) {
+		for (u32 i = buckets[b]; i != NIL; i = ents[i].next) {
+			if (invalidate)
+				notify_inval_entry(ents[i].parent_id, ents[i].name);
+			lt_mfree(alloc, ents[i].name.str);
+		}
+	}
+}
+
+void negcache_terminate(void) {
+	if (!ents)
+		return;
+
+	free_names(0);
+	lt_mfree(alloc, ents);
+	lt_mfree(alloc, buckets);
+	ents = NULL;
+	buckets = NULL;
+}
+
+b8 negcache_record(usz parent_id, lstr_t name) {
+	if (!ents)
+		return 0;
+
+	u32 hash = hash_nocase(name);
+	u32 bucket = key_bucket(parent_id, hash);
+
+	pthread_mutex_lock(&lock);
+
+	for (u32 i = buckets[bucket]; i != NIL; i = ents[i].next) {
+		if (ents[i].parent_id == parent_id && lt_lseq(ents[i].name, name))
+			goto done;
+	}
+
+	if (ent_free == NIL) {
+		free_names(1);
+		reset();
+	}
+
+	u32 idx = ent_free;
+	ent_free = ents[idx].next;
+	ents[idx] = (negcache_ent_t) {
+			.parent_id = parent_id,
+			.hash = hash,
+			.next = buckets[bucket],
+			.name = lt_strdup(alloc, name) };
+	buckets[bucket] = idx;
+	++ent_count;
+
+done:
+	pthread_mutex_unlock(&lock);
+	return 1;
+}
+
+void negcache_forget(usz parent_id, lstr_t name) {
+	if (!ents || __atomic_load_n(&ent_count, __ATOMIC_RELAXED) == 0)
+		return;
+
+	u32 hash = hash_nocase(name);
+
+	pthread_mutex_lock(&lock);
+
+	u32* link = &buckets[key_bucket(parent_id, hash)];
+	while (*link != NIL) {
+		negcache_ent_t* ent = &ents[*link];
+		if (ent->parent_id != parent_id || ent->hash != hash || !lseq_nocase(ent->name, name)) {
+			link = &ent->next;
+			continue;
+		}
+
+		notify_inval_entry(parent_id, ent->name);
+		lt_mfree(alloc, ent->name.str);
+
+		u32 idx = *link;
+		*link = ent->next;
+		ent->next = ent_free;
+		ent_free = idx;
+		--ent_count;
+	}
+
+	pthread_mutex_unlock(&lock);
+}
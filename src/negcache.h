@@ -0,0 +1,12 @@
+#ifndef NEGCACHE_H
+#define NEGCACHE_H 1
+
+#include <lt/fwd.h>
+
+void negcache_init(void);
+void negcache_terminate(void);
+
+b8 negcache_record(usz parent_id, lstr_t name);
+void negcache_forget(usz parent_id, lstr_t name);
+
+#endif
@@ -0,0 +1,152 @@
+#include "nocase.h"
+
+#include <lt/lt.h>
+#include <lt/str.h>
+
+#include <string.h>
+#include <immintrin.h>
+
+// strings are processed as little-endian 64-bit words with 'A'-'Z' folded to lowercase.
+// the final partial word is padded with zeroes, which is the same for both operands
+// of a comparison since their lengths are checked first.
+
+#define HASH_MUL 0x9E3779B97F4A7C15
+
+static
+u64 load_tail(char* str, usz len) {
+	u64 w = 0;
+	memcpy(&w, str, len);
+	return w;
+}
+
+// sets 0x20 in every byte in the range 'A'-'Z', leaving all other bytes (including non-ascii) unchanged
+static
+u64 fold_word(u64 w) {
+	u64 high = 0x8080808080808080;
+	u64 low7 = w & ~high;
+	u64 ge_a = low7 + 0x3F3F3F3F3F3F3F3F;
+	u64 gt_z = low7 + 0x2525252525252525;
+	u64 upper = (ge_a ^ gt_z) & ~w & high;
+	return w | (upper >> 2);
+}
+
+static
+u64 hash_mix(u64 h, u64 w) {
+	h = (h ^ w) * HASH_MUL;
+	return h ^ (h >> 29);
+}
+
+static
+u32 hash_final(u64 h) {
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCD;
+	h ^= h >> 33;
+	return h;
+}
+
+static
+b8 lseq_nocase_scalar(lstr_t a, lstr_t b) {
+	if (a.len != b.len)
+		return 0;
+
+	usz i = 0;
+	for (; i + 8 <= a.len; i += 8) {
+		u64 wa, wb;
+		memcpy(&wa, a.str + i, 8);
+		memcpy(&wb, b.str + i, 8);
+		if (wa != wb && fold_word(wa) != fold_word(wb))
+			return 0;
+	}
+	if (i == a.len)
+		return 1;
+	return fold_word(load_tail(a.str + i, a.len - i)) == fold_word(load_tail(b.str + i, b.len - i));
+}
+
+static
+u32 hash_nocase_scalar(lstr_t str) {
+	u64 h = str.len * HASH_MUL;
+
+	usz i = 0;
+	for (; i + 8 <= str.len; i += 8) {
+		u64 w;
+		memcpy(&w, str.str + i, 8);
+		h = hash_mix(h, fold_word(w));
+	}
+	if (i < str.len)
+		h = hash_mix(h, fold_word(load_tail(str.str + i, str.len - i)));
+	return hash_final(h);
+}
+
+// 'A'-'Z' are moved to the bottom of the signed byte range, so a single signed comparison finds them
+__attribute__((target("avx2")))
+static
+__m256i fold_avx2(__m256i v) {
+	__m256i shifted = _mm256_add_epi8(v, _mm256_set1_epi8(0x80 - 'A'));
+	__m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(-128 + 26), shifted);
+	return _mm256_or_si256(v, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+
+__attribute__((target("avx2")))
+static
+b8 lseq_nocase_avx2(lstr_t a, lstr_t b) {
+	if (a.len != b.len)
+		return 0;
+
+	usz i = 0;
+	for (; i + 32 <= a.len; i += 32) {
+		__m256i va = _mm256_loadu_si256((__m256i*)(a.str + i));
+		__m256i vb = _mm256_loadu_si256((__m256i*)(b.str + i));
+		__m256i eq = _mm256_cmpeq_epi8(fold_avx2(va), fold_avx2(vb));
+		if ((u32)_mm256_movemask_epi8(eq) != 0xFFFFFFFF)
+			return 0;
+	}
+	if (i == a.len)
+		return 1;
+
+	// the remainder is copied out, so that nothing past the end of either string is read
+	u8 ta[32] = {0}, tb[32] = {0};
+	memcpy(ta, a.str + i, a.len - i);
+	memcpy(tb, b.str + i, b.len - i);
+	__m256i va = _mm256_loadu_si256((__m256i*)ta);
+	__m256i vb = _mm256_loadu_si256((__m256i*)tb);
+	__m256i eq = _mm256_cmpeq_epi8(fold_avx2(va), fold_avx2(vb));
+	return (u32)_mm256_movemask_epi8(eq) == 0xFFFFFFFF;
+}
+
+__attribute__((target("avx2")))
+static
+u32 hash_nocase_avx2(lstr_t str) {
+	u64 h = str.len * HASH_MUL;
+
+	u64 words[4];
+	usz i = 0;
+	for (; i + 32 <= str.len; i += 32) {
+		__m256i v = fold_avx2(_mm256_loadu_si256((__m256i*)(str.str + i)));
+		_mm256_storeu_si256((__m256i*)words, v);
+		for (usz j = 0; j < 4; ++j)
+			h = hash_mix(h, words[j]);
+	}
+
+	// the remaining words go through the scalar fold, which avoids copying short names around
+	for (; i + 8 <= str.len; i += 8) {
+		u64 w;
+		memcpy(&w, str.str + i, 8);
+		h = hash_mix(h, fold_word(w));
+	}
+	if (i < str.len)
+		h = hash_mix(h, fold_word(load_tail(str.str + i, str.len - i)));
+	return hash_final(h);
+}
+
+b8 (*lseq_nocase)(lstr_t a, lstr_t b) = lseq_nocase_scalar;
+u32 (*hash_nocase)(lstr_t str) = hash_nocase_scalar;
+
+__attribute__((constructor))
+static
+void nocase_select_impl(void) {
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		lseq_nocase = lseq_nocase_avx2;
+		hash_nocase = hash_nocase_avx2;
+	}
+}
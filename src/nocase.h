@@ -0,0 +1,13 @@
+#ifndef NOCASE_H
+#define NOCASE_H 1
+
+#include <lt/fwd.h>
+
+// ascii case-insensitive string comparison and hashing.
+// an avx2 implementation is selected at startup if the cpu supports it,
+// both implementations produce identical results.
+
+extern b8 (*lseq_nocase)(lstr_t a, lstr_t b);
+extern u32 (*hash_nocase)(lstr_t str);
+
+#endif
@@ -0,0 +1,118 @@
+#include "notify.h"
+
+#include <lt/mem.h>
+#include <lt/str.h>
+#include <lt/thread.h>
+#include <lt/io.h>
+
+#include <string.h>
+#include <pthread.h>
+
+#define FUSE_USE_VERSION 312
+#include <fuse3/fuse_lowlevel.h>
+
+#define alloc lt_libc_heap
+
+// kernel cache invalidations are sent from a separate thread, since the kernel may still hold
+// locks on behalf of the request that caused them, which would deadlock the handler.
+
+#define NOTIFY_ENTRY 0
+#define NOTIFY_INODE 1
+
+typedef
+struct notify_req {
+	struct notify_req* next;
+	u8 type;
+	usz id;
+	lstr_t name;
+} notify_req_t;
+
+static struct fuse_session* session = NULL;
+static lt_thread_t* thread = NULL;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static notify_req_t* head = NULL;
+static notify_req_t* tail = NULL;
+static b8 stop = 0;
+
+static
+void notify_proc(void* usr) {
+	pthread_mutex_lock(&lock);
+	for (;;) {
+		while (!head && !stop)
+			pthread_cond_wait(&cond, &lock);
+		if (!head)
+			break;
+
+		notify_req_t* req = head;
+		head = req->next;
+		if (!head)
+			tail = NULL;
+		pthread_mutex_unlock(&lock);
+
+		// failures only mean that the kernel had nothing cached
+		if (req->type == NOTIFY_ENTRY)
+			fuse_lowlevel_notify_inval_entry(session, req->id, req->name.str, req->name.len);
+		else
+			fuse_lowlevel_notify_inval_inode(session, req->id, 0, 0);
+
+		lt_mfree(alloc, req->name.str);
+		lt_mfree(alloc, req);
+		pthread_mutex_lock(&lock);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void notify_init(struct fuse_session* session_) {
+	session = session_;
+	stop = 0;
+	thread = lt_thread_create(notify_proc, NULL, alloc);
+	if (!thread)
+		lt_ferrf("failed to create thread\n");
+}
+
+void notify_terminate(void) {
+	if (!thread)
+		return;
+
+	pthread_mutex_lock(&lock);
+	stop = 1;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+
+	while (!lt_thread_join(thread, alloc))
+		;
+	thread = NULL;
+	session = NULL;
+}
+
+static
+void notify_push(u8 type, usz id, lstr_t name) {
+	if (!thread)
+		return;
+
+	notify_req_t* req = lt_malloc(alloc, sizeof(notify_req_t));
+	LT_ASSERT(req != NULL);
+	*req = (notify_req_t) {
+			.type = type,
+			.id = id,
+			.name = name.len ? lt_strdup(alloc, name) : LSTR(NULL, 0) };
+
+	pthread_mutex_lock(&lock);
+	if (tail)
+		tail->next = req;
+	else
+		head = req;
+	tail = req;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+void notify_inval_entry(usz parent_id, lstr_t name) {
+	notify_push(NOTIFY_ENTRY, parent_id, name);
+}
+
+void notify_inval_inode(usz id) {
+	notify_push(NOTIFY_INODE, id, LSTR(NULL, 0));
+}
@@ -0,0 +1,14 @@
+#ifndef NOTIFY_H
+#define NOTIFY_H 1
+
+#include <lt/fwd.h>
+
+struct fuse_session;
+
+void notify_init(struct fuse_session* session);
+void notify_terminate(void);
+
+void notify_inval_entry(usz parent_id, lstr_t name);
+void notify_inval_inode(usz id);
+
+#endif
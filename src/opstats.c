@@ -0,0 +1,108 @@
+#include "opstats.h"
+
+#include <lt/mem.h>
+#include <lt/str.h>
+#include <lt/darr.h>
+
+#include <time.h>
+
+#define alloc lt_libc_heap
+
+// counters are updated with relaxed atomics from every libfuse thread, so a snapshot
+// may be slightly inconsistent between fields but never needs a lock.
+// latencies are bucketed by powers of two, bucket n counts calls below 2^n microseconds.
+
+#define OPSTATS_BUCKETS 24
+
+typedef
+struct op_stat {
+	u64 count;
+	u64 total_ns;
+	u64 max_ns;
+	u64 hist[OPSTATS_BUCKETS];
+} __attribute__((aligned(64))) op_stat_t;
+
+static char* op_names[OP_COUNT] = {
+	[OP_LOOKUP] = "lookup",
+	[OP_GETATTR] = "getattr",
+	[OP_OPEN] = "open",
+	[OP_READ] = "read",
+	[OP_WRITE] = "write",
+	[OP_READDIRPLUS] = "readdirplus",
+	[OP_CREATE] = "create",
+	[OP_RENAME] = "rename",
+};
+
+static op_stat_t stats[OP_COUNT];
+static b8 enabled = 0;
+
+void opstats_init(b8 enabled_) {
+	enabled = enabled_;
+}
+
+static
+u64 time_nsec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+u64 opstats_begin(void) {
+	if (!enabled)
+		return 0;
+	return time_nsec();
+}
+
+void opstats_end(u8 op, u64 start) {
+	if (!start)
+		return;
+
+	u64 ns = time_nsec() - start;
+	op_stat_t* stat = &stats[op];
+	__atomic_fetch_add(&stat->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stat->total_ns, ns, __ATOMIC_RELAXED);
+
+	u64 max = __atomic_load_n(&stat->max_ns, __ATOMIC_RELAXED);
+	while (ns > max && !__atomic_compare_exchange_n(&stat->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+
+	u64 us = ns / 1000;
+	usz bucket = us ? 64 - __builtin_clzll(us) : 0;
+	if (bucket >= OPSTATS_BUCKETS)
+		bucket = OPSTATS_BUCKETS - 1;
+	__atomic_fetch_add(&stat->hist[bucket], 1, __ATOMIC_RELAXED);
+}
+
+static
+void out_append(lt_darr(char)* out, lstr_t str) {
+	lt_darr_insert(*out, lt_darr_count(*out), str.str, str.len);
+	lt_mfree(alloc, str.str);
+}
+
+void opstats_write(lt_darr(char)* out) {
+	if (!enabled)
+		return;
+
+	for (usz i = 0; i < OP_COUNT; ++i) {
+		op_stat_t* stat = &stats[i];
+		char* name = op_names[i];
+
+		out_append(out, lt_lsbuild(alloc, "%s_count %uq\n", name, __atomic_load_n(&stat->count, __ATOMIC_RELAXED)));
+		out_append(out, lt_lsbuild(alloc, "%s_time_us %uq\n", name, __atomic_load_n(&stat->total_ns, __ATOMIC_RELAXED) / 1000));
+		out_append(out, lt_lsbuild(alloc, "%s_max_us %uq\n", name, __atomic_load_n(&stat->max_ns, __ATOMIC_RELAXED) / 1000));
+
+		// trailing empty buckets are left out
+		u64 hist[OPSTATS_BUCKETS];
+		usz used = 0;
+		for (usz j = 0; j < OPSTATS_BUCKETS; ++j) {
+			hist[j] = __atomic_load_n(&stat->hist[j], __ATOMIC_RELAXED);
+			if (hist[j])
+				used = j + 1;
+		}
+
+		out_append(out, lt_lsbuild(alloc, "%s_hist", name));
+		for (usz j = 0; j < used; ++j)
+			out_append(out, lt_lsbuild(alloc, " %uq", hist[j]));
+		out_append(out, lt_lsbuild(alloc, "\n"));
+	}
+}
@@ -0,0 +1,25 @@
+#ifndef OPSTATS_H
+#define OPSTATS_H 1
+
+#include <lt/fwd.h>
+
+#define OP_LOOKUP		0
+#define OP_GETATTR		1
+#define OP_OPEN			2
+#define OP_READ			3
+#define OP_WRITE		4
+#define OP_READDIRPLUS	5
+#define OP_CREATE		6
+#define OP_RENAME		7
+#define OP_COUNT		8
+
+void opstats_init(b8 enabled);
+
+// returns 0 if statistics are disabled, in which case opstats_end does nothing
+u64 opstats_begin(void);
+void opstats_end(u8 op, u64 start);
+
+// append the counters and latency histograms as 'key value' lines
+void opstats_write(lt_darr(char)* out);
+
+#endif
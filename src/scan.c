@@ -0,0 +1,299 @@
+#define _GNU_SOURCE
+
+#include "scan.h"
+#include "mod.h"
+
+#include <lt/mem.h>
+#include <lt/str.h>
+#include <lt/io.h>
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#define alloc lt_libc_heap
+
+static
+void attr_from_statx(vfs_attr_t* out, struct statx* stx) {
+	*out = (vfs_attr_t) {
+			.size = stx->stx_size,
+			.blocks = stx->stx_blocks,
+			.atime = { stx->stx_atime.tv_sec, stx->stx_atime.tv_nsec },
+			.mtime = { stx->stx_mtime.tv_sec, stx->stx_mtime.tv_nsec },
+			.ctime = { stx->stx_ctime.tv_sec, stx->stx_ctime.tv_nsec } };
+}
+
+static
+u32 scan_push(mod_scan_t* scan, u32 parent, u8 type, char* name, struct statx* stx) {
+	if (scan->ent_count == scan->ent_cap) {
+		scan->ent_cap = scan->ent_cap ? scan->ent_cap * 2 : 256;
+		scan->ents = lt_mrealloc(alloc, scan->ents, scan->ent_cap * sizeof(scan_ent_t));
+		LT_ASSERT(scan->ents != NULL);
+	}
+
+	usz len = strlen(name);
+	if (scan->names_size + len > scan->names_cap) {
+		while (scan->names_size + len > scan->names_cap)
+			scan->names_cap = scan->names_cap ? scan->names_cap * 2 : 4096;
+		scan->names = lt_mrealloc(alloc, scan->names, scan->names_cap);
+		LT_ASSERT(scan->names != NULL);
+	}
+
+	u32 idx = scan->ent_count++;
+	scan_ent_t* ent = &scan->ents[idx];
+	*ent = (scan_ent_t) {
+			.parent = parent,
+			.name_off = scan->names_size,
+			.name_len = len,
+			.type = type,
+			.has_attr = stx != NULL };
+	if (stx)
+		attr_from_statx(&ent->attr, stx);
+
+	memcpy(scan->names + scan->names_size, name, len);
+	scan->names_size += len;
+	return idx;
+}
+
+#define DENTS_BUFSZ LT_KB(64)
+
+struct linux_dirent64 {
+	u64 d_ino;
+	i64 d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+// every entry of a directory is read before descending into its subdirectories,
+// so that a single getdents buffer can be shared by the whole recursion
+static
+void scan_dir(mod_t* mod, mod_scan_t* scan, int fd, u32 dir_idx, char* buf, b8 recurse) {
+	u32 first_child = scan->ent_count;
+
+	isz len;
+	while ((len = syscall(SYS_getdents64, fd, buf, DENTS_BUFSZ)) > 0) {
+		for (isz off = 0; off < len;) {
+			struct linux_dirent64* ent = (struct linux_dirent64*)(buf + off);
+			off += ent->d_reclen;
+
+			if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+				continue;
+
+			// stat relative to the open directory, so no path has to be resolved
+			struct statx stx;
+			struct statx* stxp = NULL;
+			u32 type = ent->d_type;
+			if (statx(fd, ent->d_name, AT_SYMLINK_NOFOLLOW|AT_STATX_DONT_SYNC, STATX_BASIC_STATS, &stx) == 0) {
+				stxp = &stx;
+				if (type == DT_UNKNOWN)
+					type = IFTODT(stx.stx_mode);
+			}
+
+			switch (type) {
+			case DT_DIR: scan_push(scan, dir_idx, VI_DIR, ent->d_name, stxp); break;
+			case DT_REG: scan_push(scan, dir_idx, VI_REG, ent->d_name, stxp); break;
+
+			case DT_LNK:
+			default:
+				lt_werrf("unhandled file type for '%s', entry ignored\n", ent->d_name);
+				break;
+			}
+		}
+	}
+	if (len < 0)
+		lt_werrf("failed to read directory in mod '%S': %s\n", mod->name, lt_os_err_str());
+	if (!recurse)
+		return;
+
+	u32 last_child = scan->ent_count;
+	for (u32 i = first_child; i < last_child; ++i) {
+		if (scan->ents[i].type != VI_DIR)
+			continue;
+
+		char name[NAME_MAX + 1];
+		lstr_t child_name = scan_ent_name(scan, &scan->ents[i]);
+		memcpy(name, child_name.str, child_name.len);
+		name[child_name.len] = 0;
+
+		int child_fd = openat(fd, name, O_RDONLY|O_DIRECTORY);
+		if (child_fd < 0) {
+			lt_werrf("failed to open directory '%s' in mod '%S': %s\n", name, mod->name, lt_os_err_str());
+			continue;
+		}
+		scan_dir(mod, scan, child_fd, i, buf, 1);
+		close(child_fd);
+	}
+}
+
+lt_err_t scan_mod(mod_t* mod, mod_scan_t* out) {
+	*out = (mod_scan_t) { .owned = 1 };
+
+	struct statx stx;
+	if (statx(mod->rootfd, "", AT_EMPTY_PATH|AT_STATX_DONT_SYNC, STATX_BASIC_STATS, &stx) != 0)
+		return LT_ERR_UNKNOWN;
+	scan_push(out, SCAN_NO_PARENT, VI_DIR, ".", &stx);
+
+	int fd = openat(mod->rootfd, ".", O_RDONLY|O_DIRECTORY);
+	if (fd < 0)
+		return LT_ERR_UNKNOWN;
+
+	char* buf = lt_malloc(alloc, DENTS_BUFSZ);
+	LT_ASSERT(buf != NULL);
+	scan_dir(mod, out, fd, 0, buf, 1);
+	lt_mfree(alloc, buf);
+
+	close(fd);
+	return LT_SUCCESS;
+}
+
+lt_err_t scan_mod_dir(mod_t* mod, char* path, mod_scan_t* out) {
+	*out = (mod_scan_t) { .owned = 1 };
+
+	int fd = openat(mod->rootfd, path, O_RDONLY|O_DIRECTORY);
+	if (fd < 0)
+		return LT_ERR_UNKNOWN;
+
+	struct statx stx;
+	struct statx* stxp = NULL;
+	if (statx(fd, "", AT_EMPTY_PATH|AT_STATX_DONT_SYNC, STATX_BASIC_STATS, &stx) == 0)
+		stxp = &stx;
+	scan_push(out, SCAN_NO_PARENT, VI_DIR, ".", stxp);
+
+	char* buf = lt_malloc(alloc, DENTS_BUFSZ);
+	LT_ASSERT(buf != NULL);
+	scan_dir(mod, out, fd, 0, buf, 0);
+	lt_mfree(alloc, buf);
+
+	close(fd);
+	return LT_SUCCESS;
+}
+
+typedef
+struct scan_pool {
+	scan_job_t* jobs;
+	usz count;
+	usz next;
+} scan_pool_t;
+
+static
+u64 time_usec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static
+void scan_worker_proc(void* usr) {
+	scan_pool_t* pool = usr;
+
+	usz idx;
+	while ((idx = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->count) {
+		scan_job_t* job = &pool->jobs[idx];
+		u64 start = time_usec();
+		if (job->reused)
+			job->reused = scan_validate(job->mod, job->scan);
+		if (!job->reused)
+			job->err = scan_mod(job->mod, job->scan);
+		job->usec = time_usec() - start;
+	}
+}
+
+void scan_mods_parallel(scan_job_t* jobs, usz count, usz threads) {
+	if (threads == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? cpus : 1;
+	}
+	if (threads > count)
+		threads = count;
+
+	scan_pool_t pool = {
+			.jobs = jobs,
+			.count = count };
+
+	// the calling thread takes part in scanning, so one thread needs no pool at all
+	lt_thread_t** workers = NULL;
+	if (threads > 1) {
+		workers = lt_malloc(alloc, (threads - 1) * sizeof(lt_thread_t*));
+		LT_ASSERT(workers != NULL);
+		for (usz i = 0; i < threads - 1; ++i) {
+			workers[i] = lt_thread_create(scan_worker_proc, &pool, alloc);
+			if (!workers[i])
+				lt_ferrf("failed to create thread\n");
+		}
+	}
+
+	scan_worker_proc(&pool);
+
+	for (usz i = 0; i + 1 < threads; ++i) {
+		while (!lt_thread_join(workers[i], alloc))
+			;
+	}
+	lt_mfree(alloc, workers);
+}
+
+void scan_free(mod_scan_t* scan) {
+	if (!scan->owned)
+		return;
+	lt_mfree(alloc, scan->ents);
+	lt_mfree(alloc, scan->names);
+}
+
+static
+usz ent_path(mod_scan_t* scan, u32 idx, char* buf, usz size) {
+	if (idx == 0) {
+		buf[0] = '.';
+		return 1;
+	}
+
+	scan_ent_t* ent = &scan->ents[idx];
+	usz len = ent_path(scan, ent->parent, buf, size);
+	if (len == 0 || len + 1 + ent->name_len >= size)
+		return 0;
+
+	buf[len++] = '/';
+	memcpy(buf + len, scan->names + ent->name_off, ent->name_len);
+	return len + ent->name_len;
+}
+
+static
+b8 timespec_eq(struct timespec a, struct timespec b) {
+	return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+// a directory's mtime changes whenever an entry is added, removed or renamed, and its ctime
+// whenever its own metadata does, so unchanged directory stamps mean the listing is still accurate
+b8 scan_validate(mod_t* mod, mod_scan_t* scan) {
+	char path[PATH_MAX];
+
+	for (u32 i = 0; i < scan->ent_count; ++i) {
+		scan_ent_t* ent = &scan->ents[i];
+		if (ent->type != VI_DIR)
+			continue;
+		if (!ent->has_attr)
+			return 0;
+
+		usz len = ent_path(scan, i, path, sizeof(path));
+		if (len == 0)
+			return 0;
+		path[len] = 0;
+
+		struct statx stx;
+		if (statx(mod->rootfd, path, AT_SYMLINK_NOFOLLOW|AT_STATX_DONT_SYNC, STATX_BASIC_STATS, &stx) != 0)
+			return 0;
+		if (!S_ISDIR(stx.stx_mode))
+			return 0;
+
+		vfs_attr_t attr;
+		attr_from_statx(&attr, &stx);
+		if (!timespec_eq(attr.mtime, ent->attr.mtime) || !timespec_eq(attr.ctime, ent->attr.ctime))
+			return 0;
+	}
+	return 1;
+}
@@ -0,0 +1,66 @@
+#ifndef SCAN_H
+#define SCAN_H 1
+
+#include <lt/fwd.h>
+#include <lt/err.h>
+
+#include "vfs.h"
+
+#define SCAN_NO_PARENT ((u32)-1)
+
+// a single file or directory found in a mod.
+// entries are stored in pre-order, so a directory always precedes its children.
+// the first entry is the mod root itself.
+typedef
+struct scan_ent {
+	u32 parent;
+	u32 name_off;
+	u16 name_len;
+	u8 type;
+	u8 has_attr;
+	vfs_attr_t attr;
+} scan_ent_t;
+
+typedef
+struct mod_scan {
+	scan_ent_t* ents;
+	usz ent_count;
+	usz ent_cap;
+
+	char* names;
+	usz names_size;
+	usz names_cap;
+
+	b8 owned;
+
+	// loaded from the index. only directories are validated against the mod on disk,
+	// files that were edited in place may have changed since their attributes were recorded.
+	b8 indexed;
+} mod_scan_t;
+
+typedef
+struct scan_job {
+	mod_t* mod;
+	mod_scan_t* scan;
+	b8 reused;
+	lt_err_t err;
+	u64 usec;
+} scan_job_t;
+
+lt_err_t scan_mod(mod_t* mod, mod_scan_t* out);
+// list a single directory of a mod without descending into it
+lt_err_t scan_mod_dir(mod_t* mod, char* path, mod_scan_t* out);
+void scan_free(mod_scan_t* scan);
+
+// scan mods on a pool of threads. jobs that are marked as reused hold a scan loaded
+// from the index, which is only replaced if it no longer matches the mod on disk.
+void scan_mods_parallel(scan_job_t* jobs, usz count, usz threads);
+
+b8 scan_validate(mod_t* mod, mod_scan_t* scan);
+
+LT_INLINE
+lstr_t scan_ent_name(mod_scan_t* scan, scan_ent_t* ent) {
+	return LSTR(scan->names + ent->name_off, ent->name_len);
+}
+
+#endif
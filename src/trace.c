@@ -0,0 +1,408 @@
+#include "trace.h"
+#include "mod.h"
+#include "fs.h"
+
+#include <lt/mem.h>
+#include <lt/str.h>
+#include <lt/io.h>
+#include <lt/thread.h>
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define alloc lt_libc_heap
+
+// a trace lists the backing files read while the game starts, each stored once, followed by
+// the ranges read from them in the order they were requested. consecutive reads of a file
+// are merged into a single range. a range of zero bytes means the file was only opened,
+// which is all that is seen of files the kernel reads directly through passthrough.
+//
+//   header
+//   files (file_count entries), each followed by its mod name and path
+//   ranges (range_count entries)
+
+#define TRACE_MAGIC 0x3152544D4C // "LMTR1"
+#define TRACE_VERSION 1
+
+#define TRACE_MAX_RANGES (1 << 20)
+#define TRACE_MAX_RANGE_SIZE ((u32)-1)
+
+// bytes prefetched from files that were opened, but not read through the vfs
+#define TRACE_OPEN_PREFETCH LT_KB(256)
+
+typedef
+struct trace_hdr {
+	u64 magic;
+	u32 version;
+	u32 file_count;
+	u32 range_count;
+	u32 pad;
+} trace_hdr_t;
+
+typedef
+struct trace_file_hdr {
+	u32 mod_len;
+	u32 path_len;
+} trace_file_hdr_t;
+
+typedef
+struct trace_range {
+	u32 file;
+	u32 size;
+	u64 off;
+} trace_range_t;
+
+typedef
+struct trace_src {
+	mod_t* mod;
+	path_node_t* path;
+} trace_src_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static b8 recording = 0;
+static u64 deadline = 0;
+
+static trace_src_t* files = NULL;
+static u32 file_count = 0;
+static u32 file_cap = 0;
+
+// open addressing on the path node pointer, slots hold (file index + 1)
+static u32* file_tab = NULL;
+static u32 file_tab_size = 0;
+
+static trace_range_t* ranges = NULL;
+static u32 range_count = 0;
+static u32 range_cap = 0;
+
+static
+u64 time_sec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static
+u32 path_slot(path_node_t* path, u32 mask) {
+	return (u32)(((u64)(usz)path * 0x9E3779B97F4A7C15) >> 32) & mask;
+}
+
+static
+void file_tab_grow(void) {
+	lt_mfree(alloc, file_tab);
+	file_tab_size = file_tab_size ? file_tab_size * 2 : 1024;
+	file_tab = lt_malloc(alloc, file_tab_size * sizeof(u32));
+	LT_ASSERT(file_tab != NULL);
+	memset(file_tab, 0, file_tab_size * sizeof(u32));
+
+	u32 mask = file_tab_size - 1;
+	for (u32 i = 0; i < file_count; ++i) {
+		u32 slot = path_slot(files[i].path, mask);
+		while (file_tab[slot])
+			slot = (slot + 1) & mask;
+		file_tab[slot] = i + 1;
+	}
+}
+
+static
+u32 file_index(mod_t* mod, path_node_t* path) {
+	if ((file_count + 1) * 2 > file_tab_size)
+		file_tab_grow();
+
+	u32 mask = file_tab_size - 1;
+	u32 slot = path_slot(path, mask);
+	for (; file_tab[slot]; slot = (slot + 1) & mask) {
+		trace_src_t* file = &files[file_tab[slot] - 1];
+		if (file->path == path && file->mod == mod)
+			return file_tab[slot] - 1;
+	}
+
+	if (file_count == file_cap) {
+		file_cap = file_cap ? file_cap * 2 : 256;
+		files = lt_mrealloc(alloc, files, file_cap * sizeof(trace_src_t));
+		LT_ASSERT(files != NULL);
+	}
+	files[file_count] = (trace_src_t) { .mod = mod, .path = path };
+	file_tab[slot] = ++file_count;
+	return file_count - 1;
+}
+
+void trace_record_start(usz seconds) {
+	pthread_mutex_lock(&lock);
+	deadline = time_sec() + seconds;
+	__atomic_store_n(&recording, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&lock);
+}
+
+b8 trace_recording(void) {
+	return __atomic_load_n(&recording, __ATOMIC_RELAXED);
+}
+
+void trace_record(mod_t* mod, path_node_t* path, u64 off, u64 size) {
+	if (!trace_recording())
+		return;
+
+	pthread_mutex_lock(&lock);
+	if (!recording)
+		goto unlock;
+	if (time_sec() >= deadline || range_count == TRACE_MAX_RANGES) {
+		__atomic_store_n(&recording, 0, __ATOMIC_RELAXED);
+		goto unlock;
+	}
+
+	u32 file = file_index(mod, path);
+	if (range_count) {
+		trace_range_t* last = &ranges[range_count - 1];
+		if (last->file == file && (size == 0 || (last->off + last->size == off && last->size + size <= TRACE_MAX_RANGE_SIZE))) {
+			last->size += size;
+			goto unlock;
+		}
+	}
+
+	if (range_count == range_cap) {
+		range_cap = range_cap ? range_cap * 2 : 1024;
+		ranges = lt_mrealloc(alloc, ranges, range_cap * sizeof(trace_range_t));
+		LT_ASSERT(ranges != NULL);
+	}
+	ranges[range_count++] = (trace_range_t) {
+			.file = file,
+			.size = size < TRACE_MAX_RANGE_SIZE ? size : TRACE_MAX_RANGE_SIZE,
+			.off = off };
+
+unlock:
+	pthread_mutex_unlock(&lock);
+}
+
+static
+void trace_clear(void) {
+	lt_mfree(alloc, files);
+	lt_mfree(alloc, file_tab);
+	lt_mfree(alloc, ranges);
+	files = NULL;
+	file_tab = NULL;
+	ranges = NULL;
+	file_count = file_cap = file_tab_size = 0;
+	range_count = range_cap = 0;
+}
+
+lt_err_t trace_write(char* path) {
+	pthread_mutex_lock(&lock);
+	__atomic_store_n(&recording, 0, __ATOMIC_RELAXED);
+
+	// nothing was read, most likely the game was never started. keep the previous trace.
+	lt_err_t err = LT_SUCCESS;
+	if (range_count == 0)
+		goto done;
+
+	err = LT_ERR_UNKNOWN;
+	char* tmp_path = lt_lsbuild(alloc, "%s.tmp%c", path, 0).str;
+	int fd = open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd < 0)
+		goto err0;
+
+	trace_hdr_t hdr = {
+			.magic = TRACE_MAGIC,
+			.version = TRACE_VERSION,
+			.file_count = file_count,
+			.range_count = range_count };
+	if (write_all(fd, &hdr, sizeof(hdr)) < 0)
+		goto err1;
+
+	for (u32 i = 0; i < file_count; ++i) {
+		char* file_path = path_str(files[i].path);
+		trace_file_hdr_t file_hdr = {
+				.mod_len = files[i].mod->name.len,
+				.path_len = strlen(file_path) };
+		if (write_all(fd, &file_hdr, sizeof(file_hdr)) < 0 ||
+			write_all(fd, files[i].mod->name.str, file_hdr.mod_len) < 0 ||
+			write_all(fd, file_path, file_hdr.path_len) < 0)
+			goto err1;
+	}
+
+	if (write_all(fd, ranges, range_count * sizeof(trace_range_t)) < 0)
+		goto err1;
+
+	if (close(fd) < 0)
+		goto err0;
+	if (rename(tmp_path, path) < 0)
+		goto err0;
+	err = LT_SUCCESS;
+	lt_mfree(alloc, tmp_path);
+	goto done;
+
+err1:	close(fd);
+err0:	unlink(tmp_path);
+		lt_mfree(alloc, tmp_path);
+done:	trace_clear();
+		pthread_mutex_unlock(&lock);
+		return err;
+}
+
+// replay
+
+typedef
+struct trace_map {
+	char* data;
+	usz size;
+	usz off;
+} trace_map_t;
+
+static lt_thread_t* replay_thread = NULL;
+static b8 replay_stop = 0;
+static char* replay_data = NULL;
+static usz replay_size = 0;
+
+static
+void* trace_take(trace_map_t* map, usz size) {
+	if (size > map->size - map->off)
+		return NULL;
+	void* ptr = map->data + map->off;
+	map->off += size;
+	return ptr;
+}
+
+// records are not aligned in the file, so fixed-size ones are copied out
+static
+b8 trace_read(trace_map_t* map, void* out, usz size) {
+	void* ptr = trace_take(map, size);
+	if (!ptr)
+		return 0;
+	memcpy(out, ptr, size);
+	return 1;
+}
+
+typedef
+struct replay_file {
+	mod_t* mod;
+	char* path;
+	u32 path_len;
+} replay_file_t;
+
+static
+int replay_open(replay_file_t* file) {
+	if (!file->mod || file->path_len >= PATH_MAX)
+		return -1;
+
+	char path[PATH_MAX];
+	memcpy(path, file->path, file->path_len);
+	path[file->path_len] = 0;
+	return openat(file->mod->rootfd, path, O_RDONLY);
+}
+
+static
+void replay_proc(void* usr) {
+	trace_map_t map = {
+			.data = replay_data,
+			.size = replay_size };
+
+	trace_hdr_t hdr;
+	if (!trace_read(&map, &hdr, sizeof(hdr)) || hdr.magic != TRACE_MAGIC || hdr.version != TRACE_VERSION)
+		goto err_invalid;
+	if (!hdr.file_count || (usz)hdr.file_count * sizeof(trace_file_hdr_t) > map.size - map.off)
+		goto err_invalid;
+
+	// files of mods that are no longer enabled are skipped
+	replay_file_t* files = lt_malloc(alloc, hdr.file_count * sizeof(replay_file_t));
+	LT_ASSERT(files != NULL);
+	for (u32 i = 0; i < hdr.file_count; ++i) {
+		trace_file_hdr_t file;
+		if (!trace_read(&map, &file, sizeof(file)))
+			goto err_invalid_files;
+		char* mod_name = trace_take(&map, file.mod_len);
+		char* path = trace_take(&map, file.path_len);
+		if (!mod_name || !path)
+			goto err_invalid_files;
+
+		files[i] = (replay_file_t) {
+				.mod = mod_find(LSTR(mod_name, file.mod_len)),
+				.path = path,
+				.path_len = file.path_len };
+	}
+
+	if ((usz)hdr.range_count * sizeof(trace_range_t) != map.size - map.off)
+		goto err_invalid_files;
+
+	// the kernel reads in the background, so this stays ahead of the game
+	// without ever waiting for the data itself
+	u32 open_file = (u32)-1;
+	int fd = -1;
+	for (u32 i = 0; i < hdr.range_count && !__atomic_load_n(&replay_stop, __ATOMIC_RELAXED); ++i) {
+		trace_range_t range;
+		trace_read(&map, &range, sizeof(range));
+		if (range.file >= hdr.file_count)
+			continue;
+
+		if (range.file != open_file) {
+			if (fd >= 0)
+				close(fd);
+			fd = replay_open(&files[range.file]);
+			open_file = range.file;
+		}
+		if (fd < 0)
+			continue;
+
+		usz size = range.size ? range.size : TRACE_OPEN_PREFETCH;
+		posix_fadvise(fd, range.off, size, POSIX_FADV_WILLNEED);
+	}
+	if (fd >= 0)
+		close(fd);
+
+	lt_mfree(alloc, files);
+	return;
+
+err_invalid_files:
+	lt_mfree(alloc, files);
+err_invalid:
+	lt_werrf("boot trace is invalid, nothing was prefetched\n");
+}
+
+void trace_replay_start(char* path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			lt_werrf("failed to open boot trace '%s': %s\n", path, lt_os_err_str());
+		return;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return;
+	}
+
+	replay_size = st.st_size;
+	replay_data = lt_malloc(alloc, replay_size);
+	LT_ASSERT(replay_data != NULL);
+
+	usz size = 0;
+	isz res;
+	while (size < replay_size && (res = read(fd, replay_data + size, replay_size - size)) > 0)
+		size += res;
+	close(fd);
+	replay_size = size;
+
+	replay_stop = 0;
+	replay_thread = lt_thread_create(replay_proc, NULL, alloc);
+	if (!replay_thread)
+		lt_ferrf("failed to create thread\n");
+}
+
+void trace_replay_stop(void) {
+	if (!replay_thread)
+		return;
+
+	__atomic_store_n(&replay_stop, 1, __ATOMIC_RELAXED);
+	while (!lt_thread_join(replay_thread, alloc))
+		;
+	replay_thread = NULL;
+
+	lt_mfree(alloc, replay_data);
+	replay_data = NULL;
+	replay_size = 0;
+}
@@ -0,0 +1,21 @@
+#ifndef TRACE_H
+#define TRACE_H 1
+
+#include <lt/fwd.h>
+#include <lt/err.h>
+
+#include "vfs.h"
+
+// record which backing files are read in the first seconds after mounting
+void trace_record_start(usz seconds);
+b8 trace_recording(void);
+void trace_record(mod_t* mod, path_node_t* path, u64 off, u64 size);
+
+// write the recorded trace and discard it, must be called before paths are freed
+lt_err_t trace_write(char* path);
+
+// prefetch the files of a previously written trace on a background thread
+void trace_replay_start(char* path);
+void trace_replay_stop(void);
+
+#endif
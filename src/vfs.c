@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #define _FILE_OFFSET_BITS 64
 
 #include "vfs.h"
@@ -14,8 +15,19 @@
 #include <ctype.h>
 
 #include "fs_nocase.h"
-
-#define FUSE_USE_VERSION 31
+#include "fs.h"
+#include "dircache.h"
+#include "scan.h"
+#include "index.h"
+#include "lazycopy.h"
+#include "notify.h"
+#include "negcache.h"
+#include "arena.h"
+#include "trace.h"
+#include "filecache.h"
+#include "opstats.h"
+
+#define FUSE_USE_VERSION 312
 #include <fuse3/fuse.h>
 #include <fuse3/fuse_lowlevel.h>
 #include <unistd.h>
@@ -28,11 +40,11 @@
 #include <sys/file.h>
 #include <dirent.h>
 #include <errno.h>
+#include <pthread.h>
+#include <limits.h>
 
 #define alloc lt_libc_heap
 
-#define ATTR_TIMEOUT 512.0
-#define ENTRY_TIMEOUT 512.0
 
 static lt_thread_t* vfs_thread = NULL;
 
@@ -41,64 +53,535 @@ static char* argv0;
 #define ID_INVAL 0
 #define ID_ROOT 1
 
-static lt_darr(vfs_inode_t) ino_tab = NULL;
+// the inode table is split into fixed-size pages that are allocated on demand,
+// so inodes never move once registered and pointers to them remain valid.
+
+#define INO_PAGE_SHIFT 10
+#define INO_PAGE_SIZE (1 << INO_PAGE_SHIFT)
+#define INO_PAGE_MASK (INO_PAGE_SIZE - 1)
+#define INO_MAX_PAGES (1 << 16)
+
+static vfs_inode_t* ino_pages[INO_MAX_PAGES];
+static usz ino_page_count = 0;
 static usz inode_id_free = ID_INVAL;
 
+#define ino_tab(id) (ino_pages[(id) >> INO_PAGE_SHIFT][(id) & INO_PAGE_MASK])
+
+// locking model for multithreaded sessions:
+// - tree_lock guards the shape of the tree; directory entry arrays and their hash tables,
+//   the inode page directory and free list, and inode ownership. handlers that only read
+//   the tree hold it shared, handlers that add, remove, redirect or free inodes hold it
+//   exclusively.
+// - lookup and fd counts are incremented by shared holders, so increments are atomic.
+//   shared holders also decrement them under the inode's striped lock, see inode_put_shared.
+//   the last decrement of an inode that has to be freed, or whose removed directory entries
+//   have to be compacted, is done with the lock held exclusively.
+// - per-inode state that readers refresh in place (cached attributes) is guarded by a striped
+//   set of mutexes, sharded by inode id.
+// - paths are never changed in place. a path whose case is corrected by a reader is queued,
+//   and swapped in the next time the lock is taken exclusively.
+// - reads and writes do not take the tree lock. they only use the open file's vfs_file_t,
+//   which holds a copy of everything they need from the inode.
+
+static pthread_rwlock_t tree_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+#define INO_LOCK_COUNT 64
+static pthread_mutex_t ino_locks[INO_LOCK_COUNT];
+
+static __thread b8 tree_writer = 0;
+
+static void path_repairs_apply(void);
+
+static
+void tree_read_lock(void) {
+	pthread_rwlock_rdlock(&tree_lock);
+}
+
+static
+void tree_write_lock(void) {
+	pthread_rwlock_wrlock(&tree_lock);
+	tree_writer = 1;
+	path_repairs_apply();
+}
+
+static
+void tree_unlock(void) {
+	tree_writer = 0;
+	pthread_rwlock_unlock(&tree_lock);
+}
+
+static
+pthread_mutex_t* ino_lock(usz id) {
+	return &ino_locks[id % INO_LOCK_COUNT];
+}
+
 extern b8 verbose;
 
+vfs_config_t vfs_config = {
+	.dirfd_cache_size = 256,
+	.threads = 1,
+	.passthrough = 1,
+	.negative_timeout = 512,
+	.trace_time = 60,
+	.file_cache_size = LT_MB(64),
+	.file_cache_max = LT_KB(64),
+	.shared_fd_max = 256,
+	.keep_cache = 1,
+	.mod_cache_timeout = 86400,
+	.output_cache_timeout = 512,
+	.max_write = LT_MB(1),
+	.op_stats = 1,
+};
+
 lt_mutex_t* vfs_ready_mut;
 struct fuse_session* fuse_session;
 
 static mod_t* output_mod;
 static mod_t* loopback_mod;
 
+// open files are tracked by a vfs_file_t stored in fi->fh
+#define fi_file(fi) ((vfs_file_t*)(usz)(fi)->fh)
+
+// passthrough is turned off by any request thread that fails to open a backing file,
+// so it is only accessed atomically
+static b8 passthrough_active = 0;
+static b8 writeback_active = 0;
+
+// request limits agreed on with the kernel
+static u32 conn_max_write = 0;
+static u32 conn_max_readahead = 0;
+static u32 conn_max_background = 0;
+
+#define passthrough_on() (__atomic_load_n(&passthrough_active, __ATOMIC_RELAXED))
+#define passthrough_off() (__atomic_store_n(&passthrough_active, 0, __ATOMIC_RELAXED))
+
+static usz shared_fd_count = 0;
+
 void inode_unlink(usz id, usz n);
 void inode_link(usz id);
 
-lt_err_t inode_insert_dirent(usz parent_id, lstr_t name, usz child_id) {
-	vfs_inode_t* parent = &ino_tab[parent_id];
-	LT_ASSERT(parent->type == VI_DIR);
+static void lazy_queue(usz id, lazy_file_t* lazy);
+
+void dir_merge(usz id);
+void dir_ensure_merged(usz id);
+
+static lstr_t build_stats(void);
+static u64 time_sec(void);
+
+// directory hash index, open addressing with linear probing.
+// slots hold (entry index + 1), zero marks an empty slot.
+// the table is followed by a bloom filter of 8 bits per slot, which lets most lookups
+// of names that do not exist return without probing at all.
+
+#define HASHTAB_MIN_SIZE 16
+
+#define dir_bloom(dir) ((u64*)((dir)->hashtab + (dir)->hashtab_size))
+
+static
+void bloom_bits(u32 hash, u32 size, u32* out_bit1, u32* out_bit2) {
+	u32 mask = size * 8 - 1;
+	*out_bit1 = hash & mask;
+	*out_bit2 = (u32)(((u64)hash * 0x9E3779B97F4A7C15) >> 32) & mask;
+}
+
+static
+b8 dir_bloom_test(vfs_inode_t* dir, u32 hash) {
+	u32 bit1, bit2;
+	bloom_bits(hash, dir->hashtab_size, &bit1, &bit2);
+	u64* bloom = dir_bloom(dir);
+	return ((bloom[bit1 / 64] >> (bit1 % 64)) & (bloom[bit2 / 64] >> (bit2 % 64)) & 1);
+}
+
+static
+void dir_hash_insert(vfs_inode_t* dir, u32 hash, u32 ent_idx) {
+	u32 bit1, bit2;
+	bloom_bits(hash, dir->hashtab_size, &bit1, &bit2);
+	u64* bloom = dir_bloom(dir);
+	bloom[bit1 / 64] |= (u64)1 << (bit1 % 64);
+	bloom[bit2 / 64] |= (u64)1 << (bit2 % 64);
+
+	u32 mask = dir->hashtab_size - 1;
+	u32 slot = hash & mask;
+	while (dir->hashtab[slot])
+		slot = (slot + 1) & mask;
+	dir->hashtab[slot] = ent_idx + 1;
+}
+
+static
+void dir_hash_rebuild(vfs_inode_t* dir) {
+	usz count = lt_darr_count(dir->entries) - dir->base_count;
+
+	u32 size = dir->hashtab_size ? dir->hashtab_size : HASHTAB_MIN_SIZE;
+	while (size < count * 2)
+		size <<= 1;
+
+	// slots and bloom filter share an allocation, 4 + 1 bytes per slot
+	if (size != dir->hashtab_size) {
+		lt_mfree(alloc, dir->hashtab);
+		dir->hashtab = lt_malloc(alloc, size * 5);
+		LT_ASSERT(dir->hashtab != NULL);
+		dir->hashtab_size = size;
+	}
+	memset(dir->hashtab, 0, size * 5);
+
+	for (usz i = dir->base_count; i < lt_darr_count(dir->entries); ++i)
+		dir_hash_insert(dir, dir->entries[i].hash, i);
+}
+
+static
+void dir_hash_free(vfs_inode_t* dir) {
+	lt_mfree(alloc, dir->hashtab);
+	dir->hashtab = NULL;
+	dir->hashtab_size = 0;
+
+	lt_mfree(alloc, dir->mph_disp);
+	lt_mfree(alloc, dir->mph_slots);
+	dir->mph_disp = NULL;
+	dir->mph_slots = NULL;
+	dir->mph_buckets = 0;
+	dir->base_count = 0;
+}
+
+// once all mods are merged, the entries of each directory are frozen into a base layer,
+// indexed by a minimal perfect hash (hash and displace). entries of the base layer do not move,
+// deleting one only marks it as not present until enough of them are, see dir_reclaim.
+// entries added afterwards form an overlay that uses the regular hash index above,
+// and is always searched first.
+
+#define MPH_MIN_COUNT 8
+#define MPH_BUCKET_LOAD 4
+#define MPH_MAX_DISP 0xFFFF
+
+static
+u32 mph_slot(u32 hash, u32 disp, u32 count) {
+	u64 h = (u64)(hash ^ (disp * 0x9E3779B9)) * 0xC2B2AE3D27D4EB4F;
+	return ((h >> 32) * count) >> 32;
+}
+
+static
+int mph_bucket_cmp(const void* a, const void* b, void* usr) {
+	u32* sizes = usr;
+	u32 size_a = sizes[*(u32*)a], size_b = sizes[*(u32*)b];
+	return (size_a < size_b) - (size_a > size_b);
+}
+
+static
+b8 dir_freeze(vfs_inode_t* dir) {
+	u32 count = lt_darr_count(dir->entries);
+	if (count < MPH_MIN_COUNT)
+		return 0;
+
+	u32 bucket_count = count / MPH_BUCKET_LOAD + 1;
+
+	// group entries by bucket
+	u32* sizes = lt_malloc(alloc, bucket_count * sizeof(u32));
+	u32* starts = lt_malloc(alloc, (bucket_count + 1) * sizeof(u32));
+	u32* members = lt_malloc(alloc, count * sizeof(u32));
+	u32* order = lt_malloc(alloc, bucket_count * sizeof(u32));
+	u16* disp = lt_malloc(alloc, bucket_count * sizeof(u16));
+	u32* slots = lt_malloc(alloc, count * sizeof(u32));
+	LT_ASSERT(sizes && starts && members && order && disp && slots);
+
+	memset(sizes, 0, bucket_count * sizeof(u32));
+	for (u32 i = 0; i < count; ++i)
+		++sizes[dir->entries[i].hash % bucket_count];
+
+	starts[0] = 0;
+	for (u32 b = 0; b < bucket_count; ++b) {
+		starts[b + 1] = starts[b] + sizes[b];
+		order[b] = b;
+		disp[b] = 0;
+	}
+	for (u32 i = 0; i < count; ++i) {
+		u32 b = dir->entries[i].hash % bucket_count;
+		members[starts[b] + --sizes[b]] = i;
+	}
+	for (u32 b = 0; b < bucket_count; ++b)
+		sizes[b] = starts[b + 1] - starts[b];
+
+	// place the largest buckets first, while most slots are still free
+	qsort_r(order, bucket_count, sizeof(u32), mph_bucket_cmp, sizes);
+
+	memset(slots, 0xFF, count * sizeof(u32));
+
+	b8 success = 1;
+	for (u32 i = 0; i < bucket_count && success; ++i) {
+		u32 b = order[i];
+		if (sizes[b] == 0)
+			break;
+
+		u32 d;
+		for (d = 1; d <= MPH_MAX_DISP; ++d) {
+			u32 placed = 0;
+			for (; placed < sizes[b]; ++placed) {
+				u32 ent_idx = members[starts[b] + placed];
+				u32 slot = mph_slot(dir->entries[ent_idx].hash, d, count);
+				if (slots[slot] != (u32)-1)
+					break;
+				slots[slot] = ent_idx;
+			}
+			if (placed == sizes[b])
+				break;
+
+			// undo the partial placement and try the next displacement
+			for (u32 j = 0; j < placed; ++j)
+				slots[mph_slot(dir->entries[members[starts[b] + j]].hash, d, count)] = (u32)-1;
+		}
 
-	lstr_t dupname = lt_lsbuild(alloc, "%S%c", name, 0);
-	--dupname.len;
+		// entries with identical hashes can never be separated
+		if (d > MPH_MAX_DISP)
+			success = 0;
+		else
+			disp[b] = d;
+	}
+
+	lt_mfree(alloc, sizes);
+	lt_mfree(alloc, starts);
+	lt_mfree(alloc, members);
+	lt_mfree(alloc, order);
+
+	if (!success) {
+		lt_mfree(alloc, disp);
+		lt_mfree(alloc, slots);
+		return 0;
+	}
+
+	lt_mfree(alloc, dir->hashtab);
+	dir->hashtab = NULL;
+	dir->hashtab_size = 0;
+
+	dir->mph_disp = disp;
+	dir->mph_slots = slots;
+	dir->mph_buckets = bucket_count;
+	dir->base_count = count;
+	dir->base_erased += dir->erased;
+	dir->erased = 0;
+	return 1;
+}
+
+static
+isz dir_base_find(vfs_inode_t* dir, u32 hash, lstr_t name) {
+	if (!dir->base_count)
+		return -1;
+
+	u32 disp = dir->mph_disp[hash % dir->mph_buckets];
+	if (!disp)
+		return -1;
+
+	u32 idx = dir->mph_slots[mph_slot(hash, disp, dir->base_count)];
+	vfs_dirent_t* ent = &dir->entries[idx];
+	if (ent->present && ent->hash == hash && lseq_nocase(ent->name, name))
+		return idx;
+	return -1;
+}
+
+// names and paths are allocated from an arena that lives as long as the mount.
+// a path is stored as a chain of nodes, each holding the parent directory and a single name,
+// so every directory prefix exists only once per mod.
+
+static arena_t name_arena;
+static path_node_t path_root = { .parent = NULL, .name = { .len = 1, .str = "." } };
+
+path_node_t* path_new(path_node_t* parent, lstr_t name) {
+	path_node_t* node = arena_alloc(&name_arena, sizeof(path_node_t), sizeof(void*));
+	*node = (path_node_t) {
+			.parent = parent,
+			.name = LSTR(arena_strdup(&name_arena, name), name.len) };
+	return node;
+}
+
+static
+usz path_build(path_node_t* node, char* buf, usz size) {
+	if (!node->parent) {
+		if (node->name.len >= size)
+			return 0;
+		memcpy(buf, node->name.str, node->name.len);
+		buf[node->name.len] = 0;
+		return node->name.len;
+	}
+
+	usz len = path_build(node->parent, buf, size);
+	if (len == 0 || len + 1 + node->name.len >= size)
+		return 0;
+
+	buf[len++] = '/';
+	memcpy(buf + len, node->name.str, node->name.len);
+	len += node->name.len;
+	buf[len] = 0;
+	return len;
+}
+
+// paths are built into a small ring of per-thread buffers, so that a few of them can be used
+// at the same time. a buffer is handed out again once PATH_BUF_COUNT more paths were built on
+// the same thread, so the result must not be kept across calls that build paths themselves,
+// such as dir_merge, merge_ent, redirect_to_output or any that log a path. paths that are
+// needed for longer are copied, or built into a buffer of the caller's own with path_build.
+#define PATH_BUF_COUNT 4
+
+static __thread char path_bufs[PATH_BUF_COUNT][PATH_MAX];
+static __thread usz path_buf_idx = 0;
+
+char* path_str(path_node_t* node) {
+	char* buf = path_bufs[path_buf_idx++ % PATH_BUF_COUNT];
+	if (!path_build(node, buf, PATH_MAX)) {
+		lt_werrf("path of '%S' exceeds PATH_MAX\n", node->name);
+		buf[0] = 0;
+	}
+	return buf;
+}
+
+#define inode_path(id) (path_str(ino_tab(id).path))
+
+// nodes are shared by every path below them and their names are also directory entry names,
+// so a path with corrected case gets new nodes up to the first directory that already matches.
+// end points past the name of node within path, names never change length.
+static
+path_node_t* path_with_case(path_node_t* node, char* path, char* end) {
+	if (!node->parent)
+		return node;
+
+	char* start = end - node->name.len;
+	if (start <= path || start[-1] != '/')
+		return node;
+
+	path_node_t* parent = path_with_case(node->parent, path, start - 1);
+	if (parent == node->parent && memcmp(start, node->name.str, node->name.len) == 0)
+		return node;
+	return path_new(parent, LSTR(start, node->name.len));
+}
+
+static
+lt_err_t dirent_push(usz parent_id, lstr_t name, usz child_id) {
+	vfs_inode_t* parent = &ino_tab(parent_id);
+	LT_ASSERT(parent->type == VI_DIR);
 
-	vfs_dirent_t ent = { .present = 1, .name = dupname, .cname = dupname.str, .id = child_id };
+	u32 hash = hash_nocase(name);
+	vfs_dirent_t ent = { .present = 1, .hash = hash, .name = name, .cname = name.str, .id = child_id };
 	lt_darr_push(parent->entries, ent);
+
+	if (!lt_lseq(name, CLSTR(".")) && !lt_lseq(name, CLSTR(".."))) {
+		ino_tab(child_id).parent = parent_id;
+		negcache_forget(parent_id, name);
+	}
+
+	usz count = lt_darr_count(parent->entries);
+	if ((count - parent->base_count) * 4 > parent->hashtab_size * 3)
+		dir_hash_rebuild(parent);
+	else
+		dir_hash_insert(parent, hash, count - 1);
+
 	inode_link(child_id);
 	return LT_SUCCESS;
 }
 
-void inode_erase_dirent(usz parent_id, usz ent_idx) {
-	LT_ASSERT(ino_tab[parent_id].entries[ent_idx].present);
-	vfs_dirent_t* ent = &ino_tab[parent_id].entries[ent_idx];
+lt_err_t inode_insert_dirent(usz parent_id, lstr_t name, usz child_id) {
+	if (lt_lseq(name, CLSTR(".")) || lt_lseq(name, CLSTR("..")))
+		return dirent_push(parent_id, name, child_id);
+	return dirent_push(parent_id, LSTR(arena_strdup(&name_arena, name), name.len), child_id);
+}
+
+// removed entries stay in place while the directory is open, as readdir offsets are entry indices.
+// removed base entries are only reclaimed once they make up a quarter of the base layer,
+// by freezing the remaining entries into a new one.
+static
+b8 dir_reclaimable(vfs_inode_t* dir) {
+	return dir->erased || dir->base_erased * 4 > dir->base_count;
+}
+
+static
+void dir_reclaim(usz id) {
+	vfs_inode_t* dir = &ino_tab(id);
+	if (dir->type != VI_DIR || dir->fds != 0 || !dir_reclaimable(dir))
+		return;
+
+	// a directory that is not merged yet is frozen once it is
+	b8 rebase = !dir->unmerged && dir->base_erased * 4 > dir->base_count;
+	for (usz i = rebase ? 0 : dir->base_count; i < lt_darr_count(dir->entries); ++i) {
+		if (!dir->entries[i].present)
+			lt_darr_erase(dir->entries, i--, 1);
+	}
+	dir->erased = 0;
+
+	if (rebase) {
+		lt_mfree(alloc, dir->mph_disp);
+		lt_mfree(alloc, dir->mph_slots);
+		dir->mph_disp = NULL;
+		dir->mph_slots = NULL;
+		dir->mph_buckets = 0;
+		dir->base_count = 0;
+		dir->base_erased = 0;
+		if (dir_freeze(dir))
+			return;
+	}
+	dir_hash_rebuild(dir);
+}
+
+// returns true if later entries were moved down to fill the gap
+b8 inode_erase_dirent(usz parent_id, usz ent_idx) {
+	LT_ASSERT(ino_tab(parent_id).entries[ent_idx].present);
+	vfs_dirent_t* ent = &ino_tab(parent_id).entries[ent_idx];
 
 	inode_unlink(ent->id, 1);
 
-	if (ino_tab[parent_id].fds != 0)
+	// base entries are never moved, so they are left behind as tombstones
+	if (ino_tab(parent_id).fds != 0 || ent_idx < ino_tab(parent_id).base_count) {
 		ent->present = 0;
-	else {
-		lt_mfree(alloc, ino_tab[parent_id].entries[ent_idx].cname);
-		lt_darr_erase(ino_tab[parent_id].entries, ent_idx, 1);
+		if (ent_idx < ino_tab(parent_id).base_count)
+			ino_tab(parent_id).base_erased++;
+		else
+			ino_tab(parent_id).erased++;
+		return 0;
 	}
+
+	lt_darr_erase(ino_tab(parent_id).entries, ent_idx, 1);
+	dir_hash_rebuild(&ino_tab(parent_id));
+	return 1;
 }
 
-void inode_register_at(usz id, u8 type, mod_t* mod, char* path) {
-	LT_ASSERT(!ino_tab[id].allocated);
+void inode_set_path(usz id, path_node_t* path) {
+	ino_tab(id).path = path;
+}
+
+void inode_register_at(usz id, u8 type, mod_t* mod, path_node_t* path) {
+	LT_ASSERT(!ino_tab(id).allocated);
 
-	ino_tab[id] = (vfs_inode_t) {
+	ino_tab(id) = (vfs_inode_t) {
 			.allocated = 1,
 			.type = type,
 			.mod = mod,
-			.real_path = path };
+			.parent = ID_INVAL };
+	inode_set_path(id, path);
 
 	if (type == VI_DIR)
-		ino_tab[id].entries = lt_darr_create(vfs_dirent_t, 8, alloc);
+		ino_tab(id).entries = lt_darr_create(vfs_dirent_t, 8, alloc);
+}
+
+static
+void inode_grow(void) {
+	if (ino_page_count >= INO_MAX_PAGES)
+		lt_ferrf("inode table exhausted\n");
+
+	vfs_inode_t* page = lt_malloc(alloc, INO_PAGE_SIZE * sizeof(vfs_inode_t));
+	LT_ASSERT(page != NULL);
+	memset(page, 0, INO_PAGE_SIZE * sizeof(vfs_inode_t));
+
+	usz base_id = ino_page_count << INO_PAGE_SHIFT;
+	ino_pages[ino_page_count++] = page;
+
+	for (usz i = INO_PAGE_SIZE; i-- > 0;) {
+		usz id = base_id + i;
+		if (id <= ID_ROOT)
+			continue;
+		page[i].next_id = inode_id_free;
+		inode_id_free = id;
+	}
 }
 
-usz inode_register(u8 type, mod_t* mod, char* path) {
-	LT_ASSERT(inode_id_free != ID_INVAL);
+usz inode_register(u8 type, mod_t* mod, path_node_t* path) {
+	if (inode_id_free == ID_INVAL)
+		inode_grow();
 	usz id = inode_id_free;
-	inode_id_free = ino_tab[id].next_id;
+	inode_id_free = ino_tab(id).next_id;
 
 	inode_register_at(id, type, mod, path);
 	return id;
@@ -106,120 +589,191 @@ usz inode_register(u8 type, mod_t* mod, char* path) {
 
 LT_INLINE
 vfs_inode_t* inode_find_by_id(usz id) {
-	return &ino_tab[id];
+	return &ino_tab(id);
 }
 
 void inode_free(usz id) {
 	LT_ASSERT(id != ID_ROOT);
-	LT_ASSERT(ino_tab[id].allocated);
+	LT_ASSERT(ino_tab(id).allocated);
 
-	if (ino_tab[id].type == VI_DIR) {
-		lt_mfree(alloc, ino_tab[id].entries[0].cname);
-		lt_mfree(alloc, ino_tab[id].entries[1].cname);
-		for (usz i = 2; i < lt_darr_count(ino_tab[id].entries); ++i) {
-			vfs_dirent_t ent = ino_tab[id].entries[i];
+	if (ino_tab(id).type == VI_DIR) {
+		for (usz i = 2; i < lt_darr_count(ino_tab(id).entries); ++i) {
+			vfs_dirent_t ent = ino_tab(id).entries[i];
 			if (ent.present)
 				inode_unlink(ent.id, 1);
-			lt_mfree(alloc, ent.cname);
 		}
-		lt_darr_destroy(ino_tab[id].entries);
-		ino_tab[id].entries = NULL;
+		lt_darr_destroy(ino_tab(id).entries);
+		ino_tab(id).entries = NULL;
+		dir_hash_free(&ino_tab(id));
+		if (ino_tab(id).sources)
+			lt_darr_destroy(ino_tab(id).sources);
+		dircache_drop(id);
+	}
+	else {
+		// the file is gone from the tree, but a rename may have kept its copy in the output directory
+		if (ino_tab(id).lazy && lazy_unused(ino_tab(id).lazy))
+			lazy_queue(id, ino_tab(id).lazy);
+		filecache_drop(id);
 	}
 
-	lt_mfree(alloc, ino_tab[id].real_path);
-
-	ino_tab[id].allocated = 0;
-	ino_tab[id].next_id = inode_id_free;
+	ino_tab(id).allocated = 0;
+	ino_tab(id).next_id = inode_id_free;
 	inode_id_free = id;
 }
 
 void inode_force_free(usz id) {
-	LT_ASSERT(ino_tab[id].allocated);
+	LT_ASSERT(ino_tab(id).allocated);
 
-	if (ino_tab[id].type == VI_DIR) {
-		lt_mfree(alloc, ino_tab[id].entries[0].cname);
-		lt_mfree(alloc, ino_tab[id].entries[1].cname);
-		for (usz i = 2; i < lt_darr_count(ino_tab[id].entries); ++i) {
-			vfs_dirent_t ent = ino_tab[id].entries[i];
+	if (ino_tab(id).type == VI_DIR) {
+		for (usz i = 2; i < lt_darr_count(ino_tab(id).entries); ++i) {
+			vfs_dirent_t ent = ino_tab(id).entries[i];
 			if (ent.present)
 				inode_force_free(ent.id);
-			lt_mfree(alloc, ent.cname);
 		}
-		lt_darr_destroy(ino_tab[id].entries);
+		lt_darr_destroy(ino_tab(id).entries);
+		dir_hash_free(&ino_tab(id));
+		if (ino_tab(id).sources)
+			lt_darr_destroy(ino_tab(id).sources);
 	}
 
-	lt_mfree(alloc, ino_tab[id].real_path);
-	ino_tab[id].allocated = 0;
+	// an output file that is missing blocks must not outlive the mount, the mod's original is used instead
+	if (ino_tab(id).lazy) {
+		if (lazy_fill(ino_tab(id).lazy) < 0) {
+			lt_werrf("failed to finish copying '%s' to output directory, removing the incomplete copy\n", inode_path(id));
+			unlinkat_nocase(output_mod->rootfd, inode_path(id), 0);
+		}
+		lazy_free(ino_tab(id).lazy);
+	}
+
+	ino_tab(id).allocated = 0;
 }
 
 b8 inode_freeable(usz id) {
-	if (ino_tab[id].type == VI_REG && ino_tab[id].links > 0)
+	if (ino_tab(id).type == VI_REG && ino_tab(id).links > 0)
 		return 0;
-	if (ino_tab[id].type == VI_DIR && ino_tab[id].links > 1)
+	if (ino_tab(id).type == VI_DIR && ino_tab(id).links > 1)
 		return 0;
 
-	return ino_tab[id].lookups == 0 && ino_tab[id].fds == 0;
+	return ino_tab(id).lookups == 0 && ino_tab(id).fds == 0;
 }
 
 void inode_unlink(usz id, usz n) {
-	LT_ASSERT(ino_tab[id].allocated);
-	LT_ASSERT(ino_tab[id].links >= n);
-	ino_tab[id].links -= n;
+	LT_ASSERT(ino_tab(id).allocated);
+	LT_ASSERT(ino_tab(id).links >= n);
+	ino_tab(id).links -= n;
 	if (inode_freeable(id))
 		inode_free(id);
 }
 
 void inode_link(usz id) {
-	ino_tab[id].links++;
+	ino_tab(id).links++;
 }
 
 void inode_forget(usz id, usz n) {
-	LT_ASSERT(ino_tab[id].allocated);
-	LT_ASSERT(ino_tab[id].lookups >= n);
-	ino_tab[id].lookups -= n;
+	LT_ASSERT(ino_tab(id).allocated);
+	LT_ASSERT(ino_tab(id).lookups >= n);
+	ino_tab(id).lookups -= n;
 	if (inode_freeable(id))
 		inode_free(id);
 }
 
 void inode_lookup(usz id) {
-	ino_tab[id].lookups++;
+	__atomic_fetch_add(&ino_tab(id).lookups, 1, __ATOMIC_RELAXED);
 }
 
 void inode_close(usz id, usz n) {
-	LT_ASSERT(ino_tab[id].allocated);
-	LT_ASSERT(ino_tab[id].fds >= n);
-	ino_tab[id].fds -= n;
-	if (ino_tab[id].fds == 0 && ino_tab[id].type == VI_DIR && ino_tab[id].entries != NULL) {
-		for (usz i = 0; i < lt_darr_count(ino_tab[id].entries); ++i) {
-			vfs_dirent_t ent = ino_tab[id].entries[i];
-			if (!ent.present) {
-				lt_mfree(alloc, ent.cname);
-				lt_darr_erase(ino_tab[id].entries, i--, 1);
-			}
-		}
-	}
+	LT_ASSERT(ino_tab(id).allocated);
+	LT_ASSERT(ino_tab(id).fds >= n);
+	ino_tab(id).fds -= n;
+	dir_reclaim(id);
 	if (inode_freeable(id))
 		inode_free(id);
 }
 
+// drop open files and lookups with the tree lock held shared. the inode's lock keeps the check
+// and the decrement together, so that threads dropping the last lookup and the last open file
+// at the same time cannot both leave the inode to the other. returns 0 without dropping anything
+// if the inode would have to be freed or compacted, the caller then takes the lock exclusively
+// and uses inode_close or inode_forget instead.
+static
+b8 inode_put_shared(usz id, usz fds, usz lookups) {
+	vfs_inode_t* inode = &ino_tab(id);
+	pthread_mutex_lock(ino_lock(id));
+	LT_ASSERT(inode->allocated);
+
+	u32 fds_left = __atomic_load_n(&inode->fds, __ATOMIC_RELAXED);
+	u32 lookups_left = __atomic_load_n(&inode->lookups, __ATOMIC_RELAXED);
+	LT_ASSERT(fds_left >= fds && lookups_left >= lookups);
+	fds_left -= fds;
+	lookups_left -= lookups;
+
+	b8 linked = inode->type == VI_DIR ? inode->links > 1 : inode->links > 0;
+	b8 teardown = fds_left == 0 && ((fds && inode->type == VI_DIR && dir_reclaimable(inode)) || (!linked && lookups_left == 0));
+	if (!teardown) {
+		__atomic_fetch_sub(&inode->fds, fds, __ATOMIC_RELAXED);
+		__atomic_fetch_sub(&inode->lookups, lookups, __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_unlock(ino_lock(id));
+	return !teardown;
+}
+
 void inode_open(usz id) {
-	ino_tab[id].fds++;
+	__atomic_fetch_add(&ino_tab(id).fds, 1, __ATOMIC_RELAXED);
 }
 
 isz inode_find_dirent_index(usz parent_id, lstr_t name) {
-	lt_darr(vfs_dirent_t) ents = ino_tab[parent_id].entries;
-	for (usz i = 0; i < lt_darr_count(ents); ++i)
-		if (ents[i].present && lt_lseq_nocase(ents[i].name, name))
-			return i;
+	vfs_inode_t* dir = &ino_tab(parent_id);
 
-	return -1;
+	u32 hash = hash_nocase(name);
+	if (!dir->hashtab_size || !dir_bloom_test(dir, hash))
+		return dir_base_find(dir, hash, name);
+
+	u32 mask = dir->hashtab_size - 1;
+	for (u32 slot = hash & mask; dir->hashtab[slot]; slot = (slot + 1) & mask) {
+		vfs_dirent_t* ent = &dir->entries[dir->hashtab[slot] - 1];
+		if (ent->present && ent->hash == hash && lseq_nocase(ent->name, name))
+			return dir->hashtab[slot] - 1;
+	}
+
+	return dir_base_find(dir, hash, name);
 }
 
 usz inode_find_dirent(usz parent_id, lstr_t name) {
 	isz idx = inode_find_dirent_index(parent_id, name);
 	if (idx == -1)
 		return ID_INVAL;
-	return ino_tab[parent_id].entries[idx].id;
+	return ino_tab(parent_id).entries[idx].id;
+}
+
+// .LMODORG in the root holds files that are generated by the vfs itself. they can be read,
+// but never changed, and the directory also tells other lmodorg processes that the vfs is mounted.
+
+static mod_t virtual_mod = { .name = { .len = 7, .str = "virtual" }, .rootfd = -1 };
+
+// second in which the size of the generated file was last refreshed, see stat_ino
+static u64 virtual_size_time = 0;
+
+static
+b8 inode_is_virtual(usz id) {
+	return ino_tab(id).mod == &virtual_mod;
+}
+
+static
+usz virtual_register(usz parent_id, u8 type, lstr_t name) {
+	path_node_t* path = path_new(ino_tab(parent_id).path, name);
+	usz id = inode_register(type, &virtual_mod, path);
+	if (type == VI_DIR) {
+		inode_insert_dirent(id, CLSTR("."), id);
+		inode_insert_dirent(id, CLSTR(".."), parent_id);
+	}
+	dirent_push(parent_id, path->name, id);
+
+	vfs_inode_t* inode = &ino_tab(id);
+	clock_gettime(CLOCK_REALTIME, &inode->attr.mtime);
+	inode->attr.atime = inode->attr.ctime = inode->attr.mtime;
+	inode->attr_valid = 1;
+	return id;
 }
 
 mode_t vi_type_to_st_mode(int vi) {
@@ -233,38 +787,249 @@ mode_t vi_type_to_st_mode(int vi) {
 void approximate_stat(fuse_ino_t ino, struct stat* out) {
 	*out = (struct stat) {
 			.st_ino = ino,
-			.st_nlink = ino_tab[ino].links,
-			.st_mode = vi_type_to_st_mode(ino_tab[ino].type) };
+			.st_nlink = ino_tab(ino).links,
+			.st_mode = vi_type_to_st_mode(ino_tab(ino).type) };
+}
+
+// paths are recorded with the exact on-disk case at scan time, so the backing file can
+// almost always be reached with a single syscall. the case-insensitive walkers are only used
+// when that misses, in which case the recorded path is corrected for subsequent calls.
+
+static
+b8 exact_path_missed(int err) {
+	return err == ENOENT || err == ENOTDIR;
+}
+
+typedef
+struct path_repair {
+	struct path_repair* next;
+	usz id;
+	path_node_t* path;
+	char* fixed;
+} path_repair_t;
+
+static pthread_mutex_t repair_lock = PTHREAD_MUTEX_INITIALIZER;
+static path_repair_t* repairs = NULL;
+
+static
+void path_repair(usz id, path_node_t* path, char* fixed) {
+	// the inode may have been freed or moved since the repair was queued
+	vfs_inode_t* inode = &ino_tab(id);
+	if (inode->allocated && inode->path == path)
+		inode_set_path(id, path_with_case(path, fixed, fixed + strlen(fixed)));
+}
+
+// the tree lock must be held exclusively
+static
+void path_repairs_apply(void) {
+	if (!__atomic_load_n(&repairs, __ATOMIC_RELAXED))
+		return;
+
+	pthread_mutex_lock(&repair_lock);
+	path_repair_t* it = repairs;
+	__atomic_store_n(&repairs, NULL, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&repair_lock);
+
+	while (it) {
+		path_repair_t* next = it->next;
+		path_repair(it->id, it->path, it->fixed);
+		lt_mfree(alloc, it->fixed);
+		lt_mfree(alloc, it);
+		it = next;
+	}
+}
+
+static
+void path_repairs_discard(void) {
+	pthread_mutex_lock(&repair_lock);
+	path_repair_t* it = repairs;
+	__atomic_store_n(&repairs, NULL, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&repair_lock);
+
+	while (it) {
+		path_repair_t* next = it->next;
+		lt_mfree(alloc, it->fixed);
+		lt_mfree(alloc, it);
+		it = next;
+	}
+}
+
+static
+void inode_repair_path(usz id) {
+	vfs_inode_t* inode = &ino_tab(id);
+	path_node_t* path = inode->path;
+	char* fixed = path_str(path);
+	if (rebuild_path_case_at(inode->mod->rootfd, fixed) < 0) {
+		if (verbose)
+			lt_werrf("failed to rebuild case of '%s'(%uz)\n", fixed, id);
+		return;
+	}
+
+	if (tree_writer) {
+		path_repair(id, path, fixed);
+		return;
+	}
+
+	usz len = strlen(fixed);
+	path_repair_t* repair = lt_malloc(alloc, sizeof(path_repair_t));
+	LT_ASSERT(repair != NULL);
+	*repair = (path_repair_t) {
+			.id = id,
+			.path = path,
+			.fixed = lt_malloc(alloc, len + 1) };
+	LT_ASSERT(repair->fixed != NULL);
+	memcpy(repair->fixed, fixed, len + 1);
+
+	pthread_mutex_lock(&repair_lock);
+	repair->next = repairs;
+	__atomic_store_n(&repairs, repair, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&repair_lock);
+}
+
+static
+b8 inode_has_parent_dir(vfs_inode_t* inode) {
+	return inode->parent != ID_INVAL && inode->path->parent != NULL;
+}
+
+static
+lstr_t inode_dir_path(vfs_inode_t* inode) {
+	return lt_lsfroms(path_str(inode->path->parent));
+}
+
+int inode_fstatat(usz id, struct stat* st) {
+	vfs_inode_t* inode = &ino_tab(id);
+
+	int res = -ENOSYS;
+	if (id != ID_ROOT && inode_has_parent_dir(inode))
+		res = dircache_fstatat(inode->mod, inode->parent, inode_dir_path(inode), inode->path->name.str, st, AT_SYMLINK_NOFOLLOW);
+	if (res == -ENOSYS) {
+		res = fstatat(inode->mod->rootfd, path_str(inode->path), st, AT_SYMLINK_NOFOLLOW);
+		if (res < 0)
+			res = -errno;
+	}
+	if (res >= 0 || !exact_path_missed(-res))
+		return res;
+
+	res = fstatat_nocase(inode->mod->rootfd, path_str(inode->path), st, AT_SYMLINK_NOFOLLOW);
+	if (res >= 0)
+		inode_repair_path(id);
+	return res;
+}
+
+int inode_openat(usz id, int flags, mode_t mode) {
+	vfs_inode_t* inode = &ino_tab(id);
+
+	int fd = -ENOSYS;
+	if (id != ID_ROOT && inode_has_parent_dir(inode))
+		fd = dircache_openat(inode->mod, inode->parent, inode_dir_path(inode), inode->path->name.str, flags, mode);
+	if (fd == -ENOSYS) {
+		fd = openat(inode->mod->rootfd, path_str(inode->path), flags, mode);
+		if (fd < 0)
+			fd = -errno;
+	}
+	if (fd >= 0 || !exact_path_missed(-fd))
+		return fd;
+
+	fd = openat_nocase(inode->mod->rootfd, path_str(inode->path), flags, mode);
+	if (fd >= 0)
+		inode_repair_path(id);
+	return fd;
+}
+
+// attributes of mod-owned files are captured during the scan and served from memory, since
+// mods cannot change while mounted. output-owned inodes are always stat'ed.
+
+void inode_set_attr(usz id, struct statx* stx) {
+	vfs_inode_t* inode = &ino_tab(id);
+	inode->attr = (vfs_attr_t) {
+			.size = stx->stx_size,
+			.blocks = stx->stx_blocks,
+			.atime = { stx->stx_atime.tv_sec, stx->stx_atime.tv_nsec },
+			.mtime = { stx->stx_mtime.tv_sec, stx->stx_mtime.tv_nsec },
+			.ctime = { stx->stx_ctime.tv_sec, stx->stx_ctime.tv_nsec } };
+	inode->attr_valid = 1;
+}
+
+static
+void inode_set_attr_stat(usz id, struct stat* st) {
+	vfs_inode_t* inode = &ino_tab(id);
+	inode->attr = (vfs_attr_t) {
+			.size = st->st_size,
+			.blocks = st->st_blocks,
+			.atime = st->st_atim,
+			.mtime = st->st_mtim,
+			.ctime = st->st_ctim };
+	inode->attr_valid = 1;
 }
 
 int stat_ino(fuse_ino_t ino, struct stat* stat_buf) {
 	approximate_stat(ino, stat_buf);
 
-	struct stat stat_real;
-	int res = fstatat_nocase(ino_tab[ino].mod->rootfd, ino_tab[ino].real_path, &stat_real, AT_SYMLINK_NOFOLLOW);
-	if (res < 0) {
-		if (-res != ENOENT) {
-			lt_werrf("stat failed for [%S] '%s'(%uq): %s\n", ino_tab[ino].mod->name, ino_tab[ino].real_path, ino, strerror(-res));
+	vfs_inode_t* inode = &ino_tab(ino);
+	pthread_mutex_t* lock = ino_lock(ino);
+	vfs_attr_t attr;
+
+	if (!inode->attr_valid || inode->mod == output_mod) {
+		struct stat stat_real;
+		int res = inode_fstatat(ino, &stat_real);
+		if (res < 0) {
+			if (-res != ENOENT) {
+				lt_werrf("stat failed for [%S] '%s'(%uq): %s\n", inode->mod->name, path_str(inode->path), ino, strerror(-res));
+			}
+			return res;
 		}
-		return res;
+
+		pthread_mutex_lock(lock);
+		inode_set_attr_stat(ino, &stat_real);
+		attr = inode->attr;
+		pthread_mutex_unlock(lock);
+	}
+	else {
+		// a generated file that is not open reports the size it would have if opened now.
+		// building it walks every inode, so only one getattr per second builds it again.
+		if (inode->mod == &virtual_mod && inode->type == VI_REG && !__atomic_load_n(&inode->fds, __ATOMIC_RELAXED)) {
+			u64 now = time_sec();
+			u64 prev = __atomic_load_n(&virtual_size_time, __ATOMIC_RELAXED);
+			if (prev != now && __atomic_compare_exchange_n(&virtual_size_time, &prev, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				lstr_t data = build_stats();
+				pthread_mutex_lock(lock);
+				inode->attr.size = data.len;
+				pthread_mutex_unlock(lock);
+				lt_mfree(alloc, data.str);
+			}
+		}
+
+		pthread_mutex_lock(lock);
+		attr = inode->attr;
+		pthread_mutex_unlock(lock);
 	}
 
-	stat_buf->st_blocks = stat_real.st_blocks;
-	stat_buf->st_atime = stat_real.st_atime;
-	stat_buf->st_mtime = stat_real.st_mtime;
-	stat_buf->st_ctime = stat_real.st_ctime;
-	stat_buf->st_size = stat_real.st_size;
+	stat_buf->st_blocks = attr.blocks;
+	stat_buf->st_atim = attr.atime;
+	stat_buf->st_mtim = attr.mtime;
+	stat_buf->st_ctim = attr.ctime;
+	stat_buf->st_size = attr.size;
 	return LT_SUCCESS;
 }
 
+// mod files cannot change while mounted, so the kernel may keep their attributes and entries
+// for much longer than those of the output directory
+static
+double inode_cache_timeout(usz id) {
+	if (ino_tab(id).mod == &virtual_mod && ino_tab(id).type == VI_REG)
+		return 0;
+	return ino_tab(id).mod == output_mod ? vfs_config.output_cache_timeout : vfs_config.mod_cache_timeout;
+}
+
 void approximate_entry(fuse_ino_t ino, struct fuse_entry_param* out) {
+	double timeout = inode_cache_timeout(ino);
 	*out = (struct fuse_entry_param) {
 			.ino = ino,
-			.attr_timeout = ATTR_TIMEOUT,
-			.entry_timeout = ENTRY_TIMEOUT,
+			.attr_timeout = timeout,
+			.entry_timeout = timeout,
 			.attr.st_ino = ino,
-			.attr.st_mode = vi_type_to_st_mode(ino_tab[ino].type),
-			.attr.st_nlink = ino_tab[ino].links };
+			.attr.st_mode = vi_type_to_st_mode(ino_tab(ino).type),
+			.attr.st_nlink = ino_tab(ino).links };
 }
 
 void lookup_ino(fuse_ino_t ino, struct fuse_entry_param* out) {
@@ -273,9 +1038,17 @@ void lookup_ino(fuse_ino_t ino, struct fuse_entry_param* out) {
 	inode_lookup(ino);
 }
 
-void make_output_path(char* dir_path) {
+// path is usually a path_str buffer, which the dir_merge calls below may hand out again,
+// so it is copied before it is walked
+void make_output_path(char* path) {
+	usz len = strlen(path);
+	LT_ASSERT(len < PATH_MAX);
+	char dir_path[PATH_MAX];
+	memcpy(dir_path, path, len + 1);
+
 	char* it = dir_path;
 	usz parent_id = ID_ROOT;
+	path_node_t* parent_path = &path_root;
 
 	for (;;) {
 		char* name_start = it;
@@ -290,19 +1063,22 @@ void make_output_path(char* dir_path) {
 		if (res < 0 && errno != EEXIST)
 			lt_werrf("failed to create output directory: %s\n", lt_os_err_str());
 
+		lt_mfree(alloc, cpath);
+
+		dir_merge(parent_id);
 		usz child_id = inode_find_dirent(parent_id, name);
 		if (child_id != ID_INVAL) {
-			lt_mfree(alloc, cpath);
-
-			if (ino_tab[child_id].type != VI_DIR)
+			if (ino_tab(child_id).type != VI_DIR)
 				return;
-			ino_tab[child_id].mod = output_mod;
+			ino_tab(child_id).mod = output_mod;
 		}
 		else {
-			child_id = inode_register(VI_DIR, output_mod, cpath);
-			inode_insert_dirent(parent_id, name, child_id);
+			path_node_t* path = path_new(parent_path, name);
+			child_id = inode_register(VI_DIR, output_mod, path);
+			dirent_push(parent_id, path->name, child_id);
 		}
 		parent_id = child_id;
+		parent_path = ino_tab(child_id).path;
 
 	next:
 		if (*it == 0)
@@ -318,6 +1094,56 @@ void vfs_init(void* usr, struct fuse_conn_info* conn) {
 		conn->want |= FUSE_CAP_SPLICE_READ;
 	if (conn->capable & FUSE_CAP_SPLICE_MOVE)
 		conn->want |= FUSE_CAP_SPLICE_MOVE;
+
+#ifdef FUSE_CAP_PASSTHROUGH
+	passthrough_off();
+	if (vfs_config.passthrough && (conn->capable & FUSE_CAP_PASSTHROUGH)) {
+		conn->want |= FUSE_CAP_PASSTHROUGH;
+		__atomic_store_n(&passthrough_active, 1, __ATOMIC_RELAXED);
+	}
+	if (verbose)
+		lt_ierrf("passthrough %s\n", passthrough_on() ? "enabled" : "unavailable");
+#endif
+
+	// larger requests mean fewer round trips for bulk reads and writes. libfuse raises the
+	// kernel's page limit per request (FUSE_MAX_PAGES) to match max_write, up to 1 MiB.
+	// readahead can only be lowered here, the kernel offers its own maximum.
+	if (vfs_config.max_write)
+		conn->max_write = vfs_config.max_write;
+	if (vfs_config.max_read)
+		conn->max_read = vfs_config.max_read;
+	if (vfs_config.max_readahead && vfs_config.max_readahead < conn->max_readahead)
+		conn->max_readahead = vfs_config.max_readahead;
+	if (vfs_config.max_background)
+		conn->max_background = vfs_config.max_background;
+	if (vfs_config.congestion_threshold)
+		conn->congestion_threshold = vfs_config.congestion_threshold;
+
+	conn_max_write = conn->max_write;
+	conn_max_readahead = conn->max_readahead;
+	conn_max_background = conn->max_background;
+	if (verbose)
+		lt_ierrf("max_write %ud, max_readahead %ud, max_background %ud\n", conn_max_write, conn_max_readahead, conn_max_background);
+
+	// the kernel does not allow passthrough and the writeback cache on the same connection
+	writeback_active = 0;
+	if (vfs_config.writeback_cache && (conn->capable & FUSE_CAP_WRITEBACK_CACHE) && !passthrough_on()) {
+		conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+		writeback_active = 1;
+	}
+	if (verbose && vfs_config.writeback_cache)
+		lt_ierrf("writeback cache %s\n", writeback_active ? "enabled" : "unavailable");
+}
+
+// with the writeback cache the kernel may read from files opened write-only to fill partial pages,
+// and positions appended writes itself
+static
+void writeback_adjust_flags(struct fuse_file_info* fi) {
+	if (!writeback_active)
+		return;
+	if ((fi->flags & O_ACCMODE) == O_WRONLY)
+		fi->flags = (fi->flags & ~O_ACCMODE) | O_RDWR;
+	fi->flags &= ~O_APPEND;
 }
 
 void vfs_destroy(void* usr) {
@@ -325,30 +1151,40 @@ void vfs_destroy(void* usr) {
 }
 
 void vfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+	u64 op_start = opstats_begin();
+	tree_read_lock();
 	if (verbose)
-		lt_ierrf("vfs_getattr called for '%s'(%uq)\n", ino_tab[ino].real_path, ino);
+		lt_ierrf("vfs_getattr called for '%s'(%uq)\n", inode_path(ino), ino);
 
 	struct stat stat_buf;
 	int res = stat_ino(ino, &stat_buf);
 	if (res < 0)
 		fuse_reply_err(req, -res);
 	else
-		fuse_reply_attr(req, &stat_buf, ATTR_TIMEOUT);
+		fuse_reply_attr(req, &stat_buf, inode_cache_timeout(ino));
+	tree_unlock();
+	opstats_end(OP_GETATTR, op_start);
 }
 
 void vfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int to_set, struct fuse_file_info* fi) {
+	tree_write_lock();
 	if (verbose)
-		lt_ierrf("vfs_setattr called for '%s'(%uq)\n", ino_tab[ino].real_path, ino);
-	vfs_inode_t* inode = &ino_tab[ino];
+		lt_ierrf("vfs_setattr called for '%s'(%uq)\n", inode_path(ino), ino);
+	vfs_inode_t* inode = &ino_tab(ino);
+
+	if (inode_is_virtual(ino)) {
+		fuse_reply_err(req, EROFS);
+		goto unlock;
+	}
 
 	if (to_set & FUSE_SET_ATTR_MODE) {
 		if (verbose)
 			lt_ierrf("SETATTR_MODE\n");
 
 		fuse_reply_err(req, EACCES);
-		return;
+		goto unlock;
 
-// 		if (fchmodat(inode->mod->rootfd, inode->real_path, attr->st_mode, AT_SYMLINK_NOFOLLOW) < 0) {
+// 		if (fchmodat(inode->mod->rootfd, path_str(inode->path), attr->st_mode, AT_SYMLINK_NOFOLLOW) < 0) {
 // 			lt_werrf("fchmodat failed: %s\n", lt_os_err_str());
 // 			fuse_reply_err(req, errno);
 // 			return;
@@ -359,8 +1195,8 @@ void vfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int to_set,
 			lt_ierrf("SETATTR_UID\n");
 
 		fuse_reply_err(req, EACCES);
-		return;
-// 		if (fchownat(inode->mod->rootfd, inode->real_path, attr->st_uid, -1, AT_SYMLINK_NOFOLLOW) < 0) {
+		goto unlock;
+// 		if (fchownat(inode->mod->rootfd, path_str(inode->path), attr->st_uid, -1, AT_SYMLINK_NOFOLLOW) < 0) {
 // 			lt_werrf("fchownat failed: %s\n", lt_os_err_str());
 // 			fuse_reply_err(req, errno);
 // 			return;
@@ -371,8 +1207,8 @@ void vfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int to_set,
 			lt_ierrf("SETATTR_GID\n");
 
 		fuse_reply_err(req, EACCES);
-		return;
-// 		if (fchownat(inode->mod->rootfd, inode->real_path, -1, attr->st_gid, AT_SYMLINK_NOFOLLOW) < 0) {
+		goto unlock;
+// 		if (fchownat(inode->mod->rootfd, path_str(inode->path), -1, attr->st_gid, AT_SYMLINK_NOFOLLOW) < 0) {
 // 			lt_werrf("fchownat failed: %s\n", lt_os_err_str());
 // 			fuse_reply_err(req, errno);
 // 			return;
@@ -384,10 +1220,16 @@ void vfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int to_set,
 		LT_ASSERT(inode->mod == output_mod);
 		LT_ASSERT(fi != NULL);
 
-		if (ftruncate(fi->fh, attr->st_size) < 0) {
-			fuse_reply_err(req, errno);
+		int res = 0;
+		if (fi_file(fi)->lazy)
+			res = lazy_truncate(fi_file(fi)->lazy, attr->st_size);
+		else if (ftruncate(fi_file(fi)->fd, attr->st_size) < 0)
+			res = -errno;
+
+		if (res < 0) {
+			fuse_reply_err(req, -res);
 			lt_werrf("ftruncate failed\n");
-			return;
+			goto unlock;
 		}
 	}
 	if (to_set & (FUSE_SET_ATTR_ATIME|FUSE_SET_ATTR_MTIME|FUSE_SET_ATTR_ATIME_NOW|FUSE_SET_ATTR_MTIME_NOW)) {
@@ -419,11 +1261,11 @@ void vfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int to_set,
 			tv[1].tv_nsec = attr->st_mtime;
 		}
 
-		if (utimensat(inode->mod->rootfd, inode->real_path, tv, AT_SYMLINK_NOFOLLOW) < 0) {
+		if (utimensat(inode->mod->rootfd, path_str(inode->path), tv, AT_SYMLINK_NOFOLLOW) < 0) {
 			int err = errno;
 			fuse_reply_err(req, err);
 			lt_werrf("utimensat failed: %s\n", strerror(err));
-			return;
+			goto unlock;
 		}
 	}
 
@@ -468,7 +1310,7 @@ void vfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int to_set,
 
 	if (err) {
 		fuse_reply_err(req, err);
-		return;
+		goto unlock;
 	}
 
 	struct stat stat_buf;
@@ -476,45 +1318,64 @@ void vfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int to_set,
 	if (res < 0)
 		fuse_reply_err(req, -res);
 	else
-		fuse_reply_attr(req, &stat_buf, ATTR_TIMEOUT);
+		fuse_reply_attr(req, &stat_buf, inode_cache_timeout(ino));
+
+unlock:
+	tree_unlock();
 }
 
 void vfs_getxattr(fuse_req_t req, fuse_ino_t ino, const char* key, size_t size) {
 	if (verbose)
-		lt_ierrf("vfs_getxattr called for '%s'(%uq) with key '%s'\n", ino_tab[ino].real_path, ino, key);
+		lt_ierrf("vfs_getxattr called for '%s'(%uq) with key '%s'\n", inode_path(ino), ino, key);
 
 	fuse_reply_err(req, EOPNOTSUPP);
 }
 
 void vfs_setxattr(fuse_req_t req, fuse_ino_t ino, const char* key, const char* val, size_t size, int flags) {
-	lt_werrf("vfs_setxattr called for '%s'(%uq) with key '%s'\n", ino_tab[ino].real_path, ino, key);
+	lt_werrf("vfs_setxattr called for '%s'(%uq) with key '%s'\n", inode_path(ino), ino, key);
 	fuse_reply_err(req, EOPNOTSUPP);
 }
 
 void vfs_lookup(fuse_req_t req, fuse_ino_t ino, const char* cname) {
+	u64 op_start = opstats_begin();
+	dir_ensure_merged(ino);
+	tree_read_lock();
 	if (verbose)
-		lt_ierrf("vfs_lookup called for '%s'(%uq)/'%s'\n", ino_tab[ino].real_path, ino, cname);
+		lt_ierrf("vfs_lookup called for '%s'(%uq)/'%s'\n", inode_path(ino), ino, cname);
 
 	lstr_t name = lt_lsfroms((char*)cname);
 
 	usz child_id = inode_find_dirent(ino, name);
 	if (child_id == ID_INVAL) {
-		fuse_reply_err(req, ENOENT);
-		return;
+		// a zero inode number lets the kernel cache the miss for entry_timeout seconds
+		if (vfs_config.negative_timeout && negcache_record(ino, name)) {
+			struct fuse_entry_param ent = {
+					.ino = 0,
+					.entry_timeout = vfs_config.negative_timeout };
+			fuse_reply_entry(req, &ent);
+		}
+		else
+			fuse_reply_err(req, ENOENT);
+		goto unlock;
 	}
 
 	struct fuse_entry_param ent;
 	lookup_ino(child_id, &ent);
 	fuse_reply_entry(req, &ent);
+
+unlock:
+	tree_unlock();
+	opstats_end(OP_LOOKUP, op_start);
 }
 
 void vfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info* fi) {
+	tree_read_lock();
 	if (verbose)
-		lt_ierrf("vfs_readdir called for '%s'(%uq)\n", ino_tab[ino].real_path, ino);
+		lt_ierrf("vfs_readdir called for '%s'(%uq)\n", inode_path(ino), ino);
 
 	usz bufoff = 0;
 
-	lt_darr(vfs_dirent_t) ents = ino_tab[ino].entries;
+	lt_darr(vfs_dirent_t) ents = ino_tab(ino).entries;
 	usz entcount = lt_darr_count(ents);
 
 	char* buf = lt_malloc(alloc, size);
@@ -535,16 +1396,18 @@ void vfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct
 reply:
 	fuse_reply_buf(req, buf, bufoff);
 	lt_mfree(alloc, buf);
-	return;
+	tree_unlock();
 }
 
 void vfs_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info* fi) {
+	u64 op_start = opstats_begin();
+	tree_read_lock();
 	if (verbose)
-		lt_ierrf("vfs_readdirplus called for '%s'(%uq)\n", ino_tab[ino].real_path, ino);
+		lt_ierrf("vfs_readdirplus called for '%s'(%uq)\n", inode_path(ino), ino);
 
 	usz bufoff = 0;
 
-	lt_darr(vfs_dirent_t) ents = ino_tab[ino].entries;
+	lt_darr(vfs_dirent_t) ents = ino_tab(ino).entries;
 	usz entcount = lt_darr_count(ents);
 
 	char* buf = lt_malloc(alloc, size);
@@ -569,22 +1432,30 @@ void vfs_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, str
 reply:
 	fuse_reply_buf(req, buf, bufoff);
 	lt_mfree(alloc, buf);
-	return;
+	tree_unlock();
+	opstats_end(OP_READDIRPLUS, op_start);
 }
 
 void vfs_mknod(fuse_req_t req, fuse_ino_t ino, const char* cname, mode_t mode, dev_t dev) {
-	lt_ferrf("vfs_mknod called for '%s'(%uq)/'%s'\n", ino_tab[ino].real_path, ino, cname);
+	lt_ferrf("vfs_mknod called for '%s'(%uq)/'%s'\n", inode_path(ino), ino, cname);
 	fuse_reply_err(req, EOPNOTSUPP);
 }
 
 void vfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info* fi) {
 	if (verbose)
-		lt_werrf("vfs_fsync called for '%s'(%uq)\n", ino_tab[ino].real_path, ino);
+		lt_werrf("vfs_fsync called for '%s'(%uq)\n", inode_path(ino), ino);
+
+	// files served from memory have no backing descriptor, and nothing to write back
+	if (fi_file(fi)->fd < 0) {
+		fuse_reply_err(req, 0);
+		return;
+	}
+
 	int res;
 	if (datasync)
-		res = fdatasync(fi->fh);
+		res = fdatasync(fi_file(fi)->fd);
 	else
-		res = fsync(fi->fh);
+		res = fsync(fi_file(fi)->fd);
 
 	if (res < 0)
 		fuse_reply_err(req, errno);
@@ -594,8 +1465,13 @@ void vfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_in
 
 void vfs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
 	if (verbose)
-		lt_ierrf("vfs_flush called for '%s'(%uq)\n", ino_tab[ino].real_path, ino);
-	int res = close(dup(fi->fh));
+		lt_ierrf("vfs_flush called for '%s'(%uq)\n", inode_path(ino), ino);
+	if (fi_file(fi)->fd < 0) {
+		fuse_reply_err(req, 0);
+		return;
+	}
+
+	int res = close(dup(fi_file(fi)->fd));
 	if (res < 0)
 		fuse_reply_err(req, errno);
 	else
@@ -603,8 +1479,13 @@ void vfs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
 }
 
 void vfs_rename(fuse_req_t req, fuse_ino_t ino1, const char* cname1, fuse_ino_t ino2, const char* cname2, unsigned int flags) {
+	u64 op_start = opstats_begin();
+	tree_write_lock();
 	if (verbose)
-		lt_ierrf("vfs_rename called for '%s'(%uq)/'%s' to '%s'(%uq)/'%s'\n", ino_tab[ino1].real_path, ino1, cname1, ino_tab[ino2].real_path, ino2, cname2);
+		lt_ierrf("vfs_rename called for '%s'(%uq)/'%s' to '%s'(%uq)/'%s'\n", inode_path(ino1), ino1, cname1, inode_path(ino2), ino2, cname2);
+
+	dir_merge(ino1);
+	dir_merge(ino2);
 
 	lstr_t name1 = lt_lsfroms((char*)cname1);
 	lstr_t name2 = lt_lsfroms((char*)cname2);
@@ -612,69 +1493,223 @@ void vfs_rename(fuse_req_t req, fuse_ino_t ino1, const char* cname1, fuse_ino_t
 	isz ent_idx = inode_find_dirent_index(ino1, name1);
 	if (ent_idx == -1) {
 		fuse_reply_err(req, ENOENT);
-		return;
+		goto unlock;
 	}
-	usz from_id = ino_tab[ino1].entries[ent_idx].id;
-	vfs_inode_t* from = &ino_tab[from_id];
+	usz from_id = ino_tab(ino1).entries[ent_idx].id;
+	vfs_inode_t* from = &ino_tab(from_id);
 
 	isz to_ent_idx = inode_find_dirent_index(ino2, name2);
-	usz to_id = to_ent_idx == -1 ? ID_INVAL : ino_tab[ino2].entries[to_ent_idx].id;
+	usz to_id = to_ent_idx == -1 ? ID_INVAL : ino_tab(ino2).entries[to_ent_idx].id;
+	if (inode_is_virtual(from_id) || inode_is_virtual(ino2) || (to_id != ID_INVAL && inode_is_virtual(to_id))) {
+		fuse_reply_err(req, EROFS);
+		goto unlock;
+	}
 	if (to_id != ID_INVAL)
-		LT_ASSERT(ino_tab[to_id].type == from->type);
+		LT_ASSERT(ino_tab(to_id).type == from->type);
 
 	if (to_id == from_id) {
 		fuse_reply_err(req, 0);
-		return;
+		goto unlock;
 	}
 
-	char* to_path = lt_lsbuild(alloc, "%s/%S%c", ino_tab[ino2].real_path, name2, 0).str;
+	path_node_t* to_path = path_new(ino_tab(ino2).path, name2);
 
-	make_output_path(from->real_path);
+	make_output_path(path_str(from->path));
 	if (from->mod == output_mod) {
-		int res = renameat(from->mod->rootfd, from->real_path, output_mod->rootfd, to_path);
+		int res = renameat(from->mod->rootfd, path_str(from->path), output_mod->rootfd, path_str(to_path));
 		if (res < 0) {
 			fuse_reply_err(req, errno);
-			lt_mfree(alloc, to_path);
-			return;
+			goto unlock;
 		}
 	}
 	else {
 		LT_ASSERT(from->type == VI_REG); // !! should also copy directories
-		int res = copyat_nocase(from->mod->rootfd, from->real_path, output_mod->rootfd, to_path);
+		int res = copyat_nocase(from->mod->rootfd, path_str(from->path), output_mod->rootfd, path_str(to_path));
 		if (res < 0) {
 			fuse_reply_err(req, -res);
-			lt_mfree(alloc, to_path);
-			return;
+			goto unlock;
 		}
 	}
 
 	if (to_id != ID_INVAL) {
-		inode_erase_dirent(ino2, to_ent_idx);
-		if (ino1 == ino2 && to_ent_idx < ent_idx)
+		if (inode_erase_dirent(ino2, to_ent_idx) && ino1 == ino2 && to_ent_idx < ent_idx)
 			--ent_idx;
 	}
 
 	to_id = inode_register(VI_REG, output_mod, to_path);
-	inode_insert_dirent(ino2, name2, to_id);
+	dirent_push(ino2, to_path->name, to_id);
 
 	inode_erase_dirent(ino1, ent_idx);
+	dir_reclaim(ino1);
+	dir_reclaim(ino2);
 
 	fuse_reply_err(req, 0);
+
+unlock:
+	tree_unlock();
+	opstats_end(OP_RENAME, op_start);
 }
 
-void redirect_to_output(usz id) {
-	vfs_inode_t* inode = &ino_tab[id];
-	if (inode->mod == output_mod)
+// lazy copies are finished on a separate thread once the last file using them is released,
+// so that copying the rest of a large file never holds up other requests. the thread holds
+// a reference to the copy while it works, and files opened in the meantime keep reading
+// missing blocks from the original. a copy that fails stays attached to its inode, and is
+// retried the next time the file is released.
+
+typedef
+struct lazy_job {
+	struct lazy_job* next;
+	usz id;
+	lazy_file_t* lazy;
+} lazy_job_t;
+
+static lt_thread_t* lazy_thread = NULL;
+
+static pthread_mutex_t lazy_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lazy_cond = PTHREAD_COND_INITIALIZER;
+static lazy_job_t* lazy_head = NULL;
+static lazy_job_t* lazy_tail = NULL;
+static b8 lazy_stop = 0;
+
+static
+void lazy_job_finish(lazy_job_t* job, int res) {
+	tree_write_lock();
+
+	vfs_inode_t* inode = &ino_tab(job->id);
+	b8 attached = inode->allocated && inode->lazy == job->lazy;
+	if (res < 0)
+		lt_werrf("failed to finish copying '%s' to output directory: %s\n", attached ? path_str(inode->path) : "(removed file)", strerror(-res));
+
+	// a file that was opened again queues the copy once more when it is released
+	if (lazy_unref(job->lazy)) {
+		if (!attached)
+			lazy_free(job->lazy);
+		else if (res == 0) {
+			lazy_free(job->lazy);
+			inode->lazy = NULL;
+		}
+	}
+
+	tree_unlock();
+}
+
+static
+void lazy_proc(void* usr) {
+	pthread_mutex_lock(&lazy_lock);
+	for (;;) {
+		while (!lazy_head && !lazy_stop)
+			pthread_cond_wait(&lazy_cond, &lazy_lock);
+		if (!lazy_head)
+			break;
+
+		lazy_job_t* job = lazy_head;
+		lazy_head = job->next;
+		if (!lazy_head)
+			lazy_tail = NULL;
+		pthread_mutex_unlock(&lazy_lock);
+
+		lazy_job_finish(job, lazy_fill(job->lazy));
+		lt_mfree(alloc, job);
+		pthread_mutex_lock(&lazy_lock);
+	}
+	pthread_mutex_unlock(&lazy_lock);
+}
+
+static
+void lazy_thread_start(void) {
+	lazy_stop = 0;
+	lazy_thread = lt_thread_create(lazy_proc, NULL, alloc);
+	if (!lazy_thread)
+		lt_ferrf("failed to create thread\n");
+}
+
+// copies that are already queued are finished before the thread exits
+static
+void lazy_thread_stop(void) {
+	pthread_mutex_lock(&lazy_lock);
+	lazy_stop = 1;
+	pthread_cond_signal(&lazy_cond);
+	pthread_mutex_unlock(&lazy_lock);
+
+	while (!lt_thread_join(lazy_thread, alloc))
+		;
+	lazy_thread = NULL;
+}
+
+// the tree lock must be held. the queue has a lock of its own, so shared holders only need
+// to make sure that the same copy is not queued twice, see inode_lazy_release.
+static
+void lazy_queue(usz id, lazy_file_t* lazy) {
+	lazy_ref(lazy);
+
+	lazy_job_t* job = lt_malloc(alloc, sizeof(lazy_job_t));
+	LT_ASSERT(job != NULL);
+	*job = (lazy_job_t) {
+			.id = id,
+			.lazy = lazy };
+
+	pthread_mutex_lock(&lazy_lock);
+	if (lazy_tail)
+		lazy_tail->next = job;
+	else
+		lazy_head = job;
+	lazy_tail = job;
+	pthread_cond_signal(&lazy_cond);
+	pthread_mutex_unlock(&lazy_lock);
+}
+
+// finish a lazy copy once no open file refers to it anymore.
+// this is also reached with the tree lock held shared, when an open fails, so the inode's
+// lock keeps two threads from both seeing the copy unused and queueing it twice.
+static
+void inode_lazy_release(usz id) {
+	vfs_inode_t* inode = &ino_tab(id);
+	pthread_mutex_lock(ino_lock(id));
+	if (inode->lazy && lazy_unused(inode->lazy))
+		lazy_queue(id, inode->lazy);
+	pthread_mutex_unlock(ino_lock(id));
+}
+
+// move a file into the output directory before it is written to.
+// the original contents are only copied if the caller is going to keep them.
+void redirect_to_output(usz id, b8 copy_data) {
+	vfs_inode_t* inode = &ino_tab(id);
+	if (inode->mod == output_mod)
 		return;
 
-	char* cpath_dir = lt_lstos(lt_lsdirname(lt_lsfroms(inode->real_path)), alloc);
-	make_output_path(cpath_dir);
+	make_output_path(path_str(inode->path->parent));
 
-	if (copyat_nocase(inode->mod->rootfd, inode->real_path, output_mod->rootfd, inode->real_path) < 0)
-		lt_werrf("failed to copy '%s'(%uz) to output directory\n", inode->real_path, id);
+	int infd = copy_data ? inode_openat(id, O_RDONLY, 0) : -1;
+	int outfd = openat_nocase(output_mod->rootfd, path_str(inode->path), O_RDWR|O_CREAT|O_TRUNC, 0666);
+	if ((copy_data && infd < 0) || outfd < 0)
+		lt_werrf("failed to copy '%s'(%uz) to output directory\n", path_str(inode->path), id);
+	else if (copy_data) {
+		// large files are copied block by block as they are written, see lazycopy.c
+		struct stat st;
+		if (vfs_config.lazy_copy_size && fstat(infd, &st) == 0 && st.st_size >= vfs_config.lazy_copy_size) {
+			inode->lazy = lazy_create(infd, outfd, st.st_size);
+			if (inode->lazy)
+				infd = outfd = -1;
+		}
+
+		if (!inode->lazy && copyfd(infd, outfd) < 0)
+			lt_werrf("failed to copy '%s'(%uz) to output directory\n", path_str(inode->path), id);
+	}
+
+	if (infd >= 0)
+		close(infd);
+	if (outfd >= 0)
+		close(outfd);
 
 	inode->mod = output_mod;
-	lt_mfree(alloc, cpath_dir);
+	inode->attr_valid = 0;
+	filecache_drop(id);
+
+	// files that are already open keep reading the original, later opens use the copy
+	inode->backing = NULL;
+
+	// pages and attributes the kernel kept for the mod's file no longer apply
+	notify_inval_inode(id);
 }
 
 int open_child(fuse_ino_t ino, char* cname, int flags, mode_t mode) {
@@ -727,7 +1762,7 @@ int open_child(fuse_ino_t ino, char* cname, int flags, mode_t mode) {
 		*flag_it++ = 'E';
 	}
 
-	vfs_inode_t* inode = &ino_tab[ino];
+	vfs_inode_t* inode = &ino_tab(ino);
 
 	if (cname != NULL) {
 		if (inode->type != VI_DIR)
@@ -737,17 +1772,15 @@ int open_child(fuse_ino_t ino, char* cname, int flags, mode_t mode) {
 
 		usz child_id = inode_find_dirent(ino, name);
 		if (child_id == ID_INVAL) {
-			make_output_path(inode->real_path);
-			char* real_path = lt_lsbuild(alloc, "%s/%s%c", inode->real_path, cname, 0).str;
+			make_output_path(path_str(inode->path));
+			path_node_t* path = path_new(inode->path, name);
 
-			int fd = openat_nocase(output_mod->rootfd, real_path, flags|O_CREAT, mode);
-			if (fd < 0) {
-				lt_mfree(alloc, real_path);
+			int fd = openat_nocase(output_mod->rootfd, path_str(path), flags|O_CREAT, mode);
+			if (fd < 0)
 				return fd;
-			}
 
-			child_id = inode_register(VI_REG, output_mod, real_path);
-			inode_insert_dirent(ino, name, child_id);
+			child_id = inode_register(VI_REG, output_mod, path);
+			dirent_push(ino, path->name, child_id);
 
 			inode_open(child_id);
 			return fd;
@@ -756,12 +1789,13 @@ int open_child(fuse_ino_t ino, char* cname, int flags, mode_t mode) {
 		ino = child_id;
 	}
 
-	if (ino_tab[ino].type == VI_DIR)
+	if (ino_tab(ino).type == VI_DIR)
 		return -EISDIR;
 
 	if (vflags & VFD_WRITE) {
-		if (ino_tab[ino].mod != output_mod) {
-			redirect_to_output(ino);
+		if (ino_tab(ino).mod != output_mod) {
+			// a truncating open discards the old contents, so there is nothing to copy
+			redirect_to_output(ino, !(vflags & VFD_TRUNC));
 		}
 	}
 	else if (!(vflags & VFD_READ)) {
@@ -769,21 +1803,230 @@ int open_child(fuse_ino_t ino, char* cname, int flags, mode_t mode) {
 		return -EOPNOTSUPP;
 	}
 
-	int fd = openat_nocase(inode->mod->rootfd, inode->real_path, flags, 0);
-	if (fd < 0)
+	// a copy that is still being finished must not bring back what the truncation removes
+	if ((vflags & VFD_TRUNC) && ino_tab(ino).lazy)
+		lazy_truncate(ino_tab(ino).lazy, 0);
+
+	int fd = inode_openat(ino, flags, 0);
+	if (fd < 0) {
+		inode_lazy_release(ino);
 		return fd;
+	}
 	inode_open(ino);
 	return fd;
 }
 
+// the inode may be redirected or change owner while the file is open, which only affects later opens
+static
+vfs_file_t* file_new(usz id, int fd) {
+	vfs_inode_t* inode = &ino_tab(id);
+	vfs_file_t* file = lt_malloc(alloc, sizeof(vfs_file_t));
+	LT_ASSERT(file != NULL);
+	*file = (vfs_file_t) {
+			.fd = fd,
+			.mod = inode->mod,
+			.path = inode->path };
+
+	// spliced reads are counted up to the size of a mod file, which cannot change while mounted
+	pthread_mutex_lock(ino_lock(id));
+	if (inode->attr_valid && inode->mod != output_mod) {
+		file->fixed_size = 1;
+		file->size = inode->attr.size;
+	}
+	pthread_mutex_unlock(ino_lock(id));
+	return file;
+}
+
+void file_attach(fuse_req_t req, struct fuse_file_info* fi, usz id, int fd) {
+	vfs_file_t* file = file_new(id, fd);
+	file->lazy = ino_tab(id).lazy;
+
+	// reads and writes of a lazily copied file have to go through the block bitmap
+	if (file->lazy)
+		lazy_ref(file->lazy);
+
+#ifdef FUSE_CAP_PASSTHROUGH
+	// let the kernel do reads and writes on the backing file directly
+	if (passthrough_on() && !file->lazy) {
+		int backing_id = fuse_passthrough_open(req, fd);
+		if (backing_id > 0) {
+			file->backing_id = backing_id;
+			fi->backing_id = backing_id;
+		}
+		else {
+			lt_werrf("fuse_passthrough_open failed, falling back to regular reads\n");
+			passthrough_off();
+		}
+	}
+#endif
+
+	fi->fh = (u64)(usz)file;
+}
+
+// small files of mods are kept in memory, so that reopening them needs no backing file at all.
+// files in the output directory can change while mounted, and are always read from disk.
+static
+filecache_ent_t* open_cached(usz id) {
+	vfs_inode_t* inode = &ino_tab(id);
+	if (!vfs_config.file_cache_size || inode->type != VI_REG || inode->mod == output_mod || inode->lazy)
+		return NULL;
+	if (!inode->attr_valid || inode->attr.size > vfs_config.file_cache_max)
+		return NULL;
+
+	filecache_ent_t* ent = filecache_get(id);
+	if (ent)
+		return ent;
+
+	int fd = inode_openat(id, O_RDONLY, 0);
+	if (fd < 0)
+		return NULL;
+	ent = filecache_load(id, fd, inode->attr.size);
+	close(fd);
+	return ent;
+}
+
+// read-only opens of an inode share a single backing descriptor, which is closed again
+// once the last of them is released. shared descriptors are counted against shared_fd_max,
+// opens beyond that get a descriptor of their own.
+// references are taken and the last one is dropped with the inode's lock held, so that
+// a descriptor that is being closed is never handed out again.
+static
+vfs_backing_t* backing_get(fuse_req_t req, usz id) {
+	vfs_inode_t* inode = &ino_tab(id);
+	if (inode->type != VI_REG || inode->lazy)
+		return NULL;
+
+	pthread_mutex_t* lock = ino_lock(id);
+	pthread_mutex_lock(lock);
+
+	vfs_backing_t* backing = inode->backing;
+	if (backing) {
+		__atomic_fetch_add(&backing->refs, 1, __ATOMIC_RELAXED);
+		goto unlock;
+	}
+
+	if (__atomic_add_fetch(&shared_fd_count, 1, __ATOMIC_RELAXED) > vfs_config.shared_fd_max)
+		goto err0;
+
+	int fd = inode_openat(id, O_RDONLY, 0);
+	if (fd < 0)
+		goto err0;
+
+	backing = lt_malloc(alloc, sizeof(vfs_backing_t));
+	LT_ASSERT(backing != NULL);
+	*backing = (vfs_backing_t) {
+			.fd = fd,
+			.refs = 1 };
+
+#ifdef FUSE_CAP_PASSTHROUGH
+	// the kernel's backing file is shared as well
+	if (passthrough_on()) {
+		int backing_id = fuse_passthrough_open(req, fd);
+		if (backing_id > 0)
+			backing->backing_id = backing_id;
+		else {
+			lt_werrf("fuse_passthrough_open failed, falling back to regular reads\n");
+			passthrough_off();
+		}
+	}
+#endif
+
+	inode->backing = backing;
+
+unlock:
+	pthread_mutex_unlock(lock);
+	return backing;
+
+err0:
+	__atomic_fetch_sub(&shared_fd_count, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(lock);
+	return NULL;
+}
+
+static
+void backing_unref(fuse_req_t req, usz id, vfs_backing_t* backing) {
+	pthread_mutex_t* lock = ino_lock(id);
+	pthread_mutex_lock(lock);
+	b8 last = !__atomic_sub_fetch(&backing->refs, 1, __ATOMIC_RELAXED);
+	if (last && ino_tab(id).backing == backing)
+		ino_tab(id).backing = NULL;
+	pthread_mutex_unlock(lock);
+	if (!last)
+		return;
+
+#ifdef FUSE_CAP_PASSTHROUGH
+	if (backing->backing_id > 0)
+		fuse_passthrough_close(req, backing->backing_id);
+#endif
+
+	close(backing->fd);
+	lt_mfree(alloc, backing);
+	__atomic_fetch_sub(&shared_fd_count, 1, __ATOMIC_RELAXED);
+}
+
+static
+void file_attach_shared(struct fuse_file_info* fi, usz id, vfs_backing_t* backing) {
+	vfs_file_t* file = file_new(id, backing->fd);
+	file->shared = backing;
+
+#ifdef FUSE_CAP_PASSTHROUGH
+	if (backing->backing_id > 0)
+		fi->backing_id = backing->backing_id;
+#endif
+
+	fi->fh = (u64)(usz)file;
+}
+
+static
+void file_attach_cached(struct fuse_file_info* fi, usz id, filecache_ent_t* cached) {
+	vfs_file_t* file = file_new(id, -1);
+	file->cached = cached;
+	fi->fh = (u64)(usz)file;
+}
+
+void file_detach(fuse_req_t req, struct fuse_file_info* fi, usz id) {
+	vfs_file_t* file = fi_file(fi);
+
+	if (file->cached)
+		filecache_unref(file->cached);
+
+	if (file->lazy) {
+		lazy_unref(file->lazy);
+		inode_lazy_release(id);
+	}
+
+#ifdef FUSE_CAP_PASSTHROUGH
+	if (file->backing_id > 0)
+		fuse_passthrough_close(req, file->backing_id);
+#endif
+
+	if (file->shared)
+		backing_unref(req, id, file->shared);
+	else if (file->fd >= 0)
+		close(file->fd);
+	if (file->data.str)
+		lt_mfree(alloc, file->data.str);
+	lt_mfree(alloc, file);
+}
+
 void vfs_create(fuse_req_t req, fuse_ino_t ino, const char* cname, mode_t mode, struct fuse_file_info* fi) {
+	u64 op_start = opstats_begin();
+	tree_write_lock();
 	if (verbose)
-		lt_ierrf("vfs_create called for '%s'(%uq)/'%s'\n", ino_tab[ino].real_path, ino, cname);
+		lt_ierrf("vfs_create called for '%s'(%uq)/'%s'\n", inode_path(ino), ino, cname);
+
+	if (inode_is_virtual(ino)) {
+		fuse_reply_err(req, EROFS);
+		goto unlock;
+	}
+
+	dir_merge(ino);
+	writeback_adjust_flags(fi);
 
 	int fd = open_child(ino, (char*)cname, fi->flags, mode);
 	if (fd < 0) {
 		fuse_reply_err(req, -(int)fd);
-		return;
+		goto unlock;
 	}
 
 	usz child_id = inode_find_dirent(ino, lt_lsfroms((char*)cname));
@@ -791,68 +2034,232 @@ void vfs_create(fuse_req_t req, fuse_ino_t ino, const char* cname, mode_t mode,
 
 	struct fuse_entry_param ent;
 	lookup_ino(child_id, &ent);
-	fi->fh = fd;
+	file_attach(req, fi, child_id, fd);
 	fuse_reply_create(req, &ent, fi);
+
+unlock:
+	tree_unlock();
+	opstats_end(OP_CREATE, op_start);
+}
+
+// the contents are generated once per open, and the inode reports their size until the last
+// open file is released. they still change between opens, so the kernel is told not to cache them.
+static
+void open_virtual(fuse_req_t req, usz id, struct fuse_file_info* fi) {
+	if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+		fuse_reply_err(req, EROFS);
+		return;
+	}
+
+	vfs_file_t* file = file_new(id, -1);
+	file->data = build_stats();
+	inode_open(id);
+
+	pthread_mutex_lock(ino_lock(id));
+	ino_tab(id).attr.size = file->data.len;
+	pthread_mutex_unlock(ino_lock(id));
+
+	fi->fh = (u64)(usz)file;
+	fi->direct_io = 1;
+	fuse_reply_open(req, fi);
 }
 
 void vfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+	u64 op_start = opstats_begin();
+	writeback_adjust_flags(fi);
+
+	// opening for writing may redirect the inode to the output mod
+	if ((fi->flags & O_ACCMODE) == O_RDONLY)
+		tree_read_lock();
+	else
+		tree_write_lock();
+
 	if (verbose)
-		lt_ierrf("vfs_open called for '%s'(%uq)\n", ino_tab[ino].real_path, ino);
+		lt_ierrf("vfs_open called for '%s'(%uq)\n", inode_path(ino), ino);
 
-	int fd = open_child(ino, NULL, fi->flags, 0);
-	if (fd < 0) {
-		fuse_reply_err(req, -(int)fd);
-		return;
+	if (inode_is_virtual(ino)) {
+		open_virtual(req, ino, fi);
+		goto unlock;
+	}
+
+	b8 read_only = (fi->flags & O_ACCMODE) == O_RDONLY;
+	filecache_ent_t* cached = read_only ? open_cached(ino) : NULL;
+	vfs_backing_t* shared = read_only && !cached && vfs_config.shared_fd_max ? backing_get(req, ino) : NULL;
+	if (cached) {
+		inode_open(ino);
+		file_attach_cached(fi, ino, cached);
+	}
+	else if (shared) {
+		inode_open(ino);
+		file_attach_shared(fi, ino, shared);
+	}
+	else {
+		int fd = open_child(ino, NULL, fi->flags, 0);
+		if (fd < 0) {
+			fuse_reply_err(req, -(int)fd);
+			goto unlock;
+		}
+		file_attach(req, fi, ino, fd);
 	}
 
-	fi->fh = fd;
+	// mod files never change, so their pages stay valid across opens
+	fi->keep_cache = vfs_config.keep_cache && ino_tab(ino).mod != output_mod;
 	fuse_reply_open(req, fi);
+
+	if (read_only)
+		trace_record(ino_tab(ino).mod, ino_tab(ino).path, 0, 0);
+
+unlock:
+	tree_unlock();
+	opstats_end(OP_OPEN, op_start);
 }
 
+// releases only need the tree lock exclusively for the last open file of a removed file
 void vfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+	tree_read_lock();
 	if (verbose)
-		lt_ierrf("vfs_release called for '%s'(%uq)\n", ino_tab[ino].real_path, ino);
+		lt_ierrf("vfs_release called for '%s'(%uq)\n", inode_path(ino), ino);
 
-	LT_ASSERT(ino_tab[ino].type == VI_REG);
+	LT_ASSERT(ino_tab(ino).type == VI_REG);
 
-	close(fi->fh);
-	inode_close(ino, 1);
+	file_detach(req, fi, ino);
+	if (!inode_put_shared(ino, 1, 0)) {
+		tree_unlock();
+		tree_write_lock();
+		inode_close(ino, 1);
+	}
 
 	fuse_reply_err(req, 0);
+	tree_unlock();
 }
 
-void vfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info* fi) {
+static
+void count_read(vfs_file_t* file, usz size) {
+	__atomic_fetch_add(&file->mod->bytes_read, size, __ATOMIC_RELAXED);
+}
+
+static
+void reply_write(fuse_req_t req, vfs_file_t* file, usz size) {
+	__atomic_fetch_add(&file->mod->bytes_written, size, __ATOMIC_RELAXED);
+	fuse_reply_write(req, size);
+}
+
+static
+void read_file(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info* fi) {
+	vfs_file_t* file = fi_file(fi);
 	if (verbose)
-		lt_ierrf("vfs_read called for '%s'(%uq)\n", ino_tab[ino].real_path, ino);
+		lt_ierrf("vfs_read called for '%s'(%uq)\n", path_str(file->path), ino);
+	if (file->data.str) {
+		if (off >= file->data.len) {
+			fuse_reply_buf(req, NULL, 0);
+			return;
+		}
+		usz len = file->data.len - off;
+		fuse_reply_buf(req, file->data.str + off, len < size ? len : size);
+		return;
+	}
+
+	trace_record(file->mod, file->path, off, size);
+
+	if (file->cached) {
+		char* data;
+		usz len = filecache_read(file->cached, &data, size, off);
+		count_read(file, len);
+		fuse_reply_buf(req, data, len);
+		return;
+	}
+
+	if (file->lazy) {
+		char* data = lt_malloc(alloc, size);
+		LT_ASSERT(data != NULL);
+		isz res = lazy_read(file->lazy, data, size, off);
+		if (res < 0)
+			fuse_reply_err(req, -res);
+		else {
+			count_read(file, res);
+			fuse_reply_buf(req, data, res);
+		}
+		lt_mfree(alloc, data);
+		return;
+	}
+
+	// spliced replies do not report their length, mod files have a known size to clamp to
+	usz len = size;
+	if (file->fixed_size) {
+		u64 left = off < file->size ? file->size - off : 0;
+		len = left < size ? left : size;
+	}
+	count_read(file, len);
 
 	struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
 	buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
-	buf.buf[0].fd = (int)fi->fh;
+	buf.buf[0].fd = file->fd;
 	buf.buf[0].pos = off;
 
 	fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
 }
 
-void vfs_write(fuse_req_t req, fuse_ino_t ino, const char* buf, size_t size, off_t off, struct fuse_file_info* fi) {
+void vfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info* fi) {
+	u64 op_start = opstats_begin();
+	read_file(req, ino, size, off, fi);
+	opstats_end(OP_READ, op_start);
+}
+
+static
+void write_file(fuse_req_t req, fuse_ino_t ino, const char* buf, size_t size, off_t off, struct fuse_file_info* fi) {
+	vfs_file_t* file = fi_file(fi);
 	if (verbose)
-		lt_ierrf("vfs_write called for '%s'(%uq)\n", ino_tab[ino].real_path, ino);
+		lt_ierrf("vfs_write called for '%s'(%uq)\n", path_str(file->path), ino);
+	if (file->lazy) {
+		isz res = lazy_write(file->lazy, (char*)buf, size, off);
+		if (res < 0)
+			fuse_reply_err(req, -res);
+		else
+			reply_write(req, file, res);
+		return;
+	}
 
-	ssize_t res = pwrite(fi->fh, buf, size, off);
+	ssize_t res = pwrite(file->fd, buf, size, off);
 	if (res < 0) {
 		fuse_reply_err(req, errno);
 		return;
 	}
 
-	fuse_reply_write(req, res);
+	reply_write(req, file, res);
 }
 
-void vfs_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec* in_buf, off_t off, struct fuse_file_info* fi) {
+void vfs_write(fuse_req_t req, fuse_ino_t ino, const char* buf, size_t size, off_t off, struct fuse_file_info* fi) {
+	u64 op_start = opstats_begin();
+	write_file(req, ino, buf, size, off, fi);
+	opstats_end(OP_WRITE, op_start);
+}
+
+static
+void write_file_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec* in_buf, off_t off, struct fuse_file_info* fi) {
+	vfs_file_t* file = fi_file(fi);
 	if (verbose)
-		lt_ierrf("vfs_write called for '%s'(%uq)\n", ino_tab[ino].real_path, ino);
+		lt_ierrf("vfs_write called for '%s'(%uq)\n", path_str(file->path), ino);
+	usz size = fuse_buf_size(in_buf);
+	struct fuse_bufvec out_buf = FUSE_BUFVEC_INIT(size);
+
+	if (file->lazy) {
+		out_buf.buf[0].mem = lt_malloc(alloc, size);
+		LT_ASSERT(out_buf.buf[0].mem != NULL);
+
+		ssize_t res = fuse_buf_copy(&out_buf, in_buf, 0);
+		if (res >= 0)
+			res = lazy_write(file->lazy, out_buf.buf[0].mem, res, off);
+		lt_mfree(alloc, out_buf.buf[0].mem);
+
+		if (res < 0)
+			fuse_reply_err(req, -res);
+		else
+			reply_write(req, file, res);
+		return;
+	}
 
-	struct fuse_bufvec out_buf = FUSE_BUFVEC_INIT(fuse_buf_size(in_buf));
 	out_buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
-	out_buf.buf[0].fd = (int)fi->fh;
+	out_buf.buf[0].fd = file->fd;
 	out_buf.buf[0].pos = off;
 
 	ssize_t res = fuse_buf_copy(&out_buf, in_buf, 0);
@@ -860,7 +2267,13 @@ void vfs_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec* in_buf, o
 	if (res < 0)
 		fuse_reply_err(req, -res);
 	else
-		fuse_reply_write(req, res);
+		reply_write(req, file, res);
+}
+
+void vfs_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec* in_buf, off_t off, struct fuse_file_info* fi) {
+	u64 op_start = opstats_begin();
+	write_file_buf(req, ino, in_buf, off, fi);
+	opstats_end(OP_WRITE, op_start);
 }
 
 void vfs_statfs(fuse_req_t req, fuse_ino_t ino) {
@@ -869,141 +2282,237 @@ void vfs_statfs(fuse_req_t req, fuse_ino_t ino) {
 }
 
 void vfs_unlink(fuse_req_t req, fuse_ino_t ino, const char* cname) {
+	tree_write_lock();
 	if (verbose)
-		lt_ierrf("vfs_unlink called for '%s'(%uq)/'%s'\n", ino_tab[ino].real_path, ino, cname);
+		lt_ierrf("vfs_unlink called for '%s'(%uq)/'%s'\n", inode_path(ino), ino, cname);
+
+	if (inode_is_virtual(ino)) {
+		fuse_reply_err(req, EROFS);
+		goto unlock;
+	}
+
+	dir_merge(ino);
 
 	isz ent_idx = inode_find_dirent_index(ino, lt_lsfroms((char*)cname));
 	if (ent_idx == -1) {
 		fuse_reply_err(req, ENOENT);
-		return;
+		goto unlock;
 	}
 
-	usz child_id = ino_tab[ino].entries[ent_idx].id;
-	if (ino_tab[child_id].type == VI_DIR) {
+	usz child_id = ino_tab(ino).entries[ent_idx].id;
+	if (ino_tab(child_id).type == VI_DIR) {
 		fuse_reply_err(req, EISDIR);
-		return;
+		goto unlock;
 	}
 
-	if (ino_tab[child_id].mod == output_mod) {
-		int res = unlinkat_nocase(output_mod->rootfd, ino_tab[child_id].real_path, 0);
+	if (ino_tab(child_id).mod == output_mod) {
+		int res = unlinkat_nocase(output_mod->rootfd, inode_path(child_id), 0);
 		if (res < 0) {
 			fuse_reply_err(req, errno);
-			return;
+			goto unlock;
 		}
 	}
 
 	inode_erase_dirent(ino, ent_idx);
+	dir_reclaim(ino);
 	fuse_reply_err(req, 0);
+
+unlock:
+	tree_unlock();
 }
 
 void vfs_mkdir(fuse_req_t req, fuse_ino_t ino, const char* cname, mode_t mode) {
+	tree_write_lock();
 	if (verbose)
-		lt_ierrf("vfs_mkdir called for '%s'(%uq)/'%s'\n", ino_tab[ino].real_path, ino, cname);
+		lt_ierrf("vfs_mkdir called for '%s'(%uq)/'%s'\n", inode_path(ino), ino, cname);
+
+	if (inode_is_virtual(ino)) {
+		fuse_reply_err(req, EROFS);
+		goto unlock;
+	}
+
+	dir_merge(ino);
 
 	lstr_t name = lt_lsfroms((char*)cname);
 	usz child_id = inode_find_dirent(ino, name);
 	if (child_id != ID_INVAL) {
 		fuse_reply_err(req, EEXIST);
-		return;
+		goto unlock;
 	}
 
-	char* real_path = lt_lsbuild(alloc, "%s/%s%c", ino_tab[ino].real_path, cname, 0).str;
-	make_output_path(ino_tab[ino].real_path);
-	int res = mkdirat_nocase(output_mod->rootfd, real_path, mode);
+	path_node_t* path = path_new(ino_tab(ino).path, name);
+	make_output_path(inode_path(ino));
+	int res = mkdirat_nocase(output_mod->rootfd, path_str(path), mode);
 	if (res < 0) {
 		fuse_reply_err(req, errno);
-		lt_mfree(alloc, real_path);
-		return;
+		goto unlock;
 	}
 
-	child_id = inode_register(VI_DIR, output_mod, real_path);
+	child_id = inode_register(VI_DIR, output_mod, path);
 	inode_insert_dirent(child_id, CLSTR("."), child_id);
 	inode_insert_dirent(child_id, CLSTR(".."), ino);
 
-	inode_insert_dirent(ino, name, child_id);
+	dirent_push(ino, path->name, child_id);
 
 	struct fuse_entry_param ent;
 	lookup_ino(child_id, &ent);
 	fuse_reply_entry(req, &ent);
+
+unlock:
+	tree_unlock();
 }
 
 void vfs_rmdir(fuse_req_t req, fuse_ino_t ino, const char* cname) {
+	tree_write_lock();
 	if (verbose)
-		lt_ierrf("vfs_rmdir called for '%s'(%uq)/'%s'\n", ino_tab[ino].real_path, ino, cname);
+		lt_ierrf("vfs_rmdir called for '%s'(%uq)/'%s'\n", inode_path(ino), ino, cname);
+
+	dir_merge(ino);
 
 	isz ent_idx = inode_find_dirent_index(ino, lt_lsfroms((char*)cname));
 	if (ent_idx == -1) {
 		fuse_reply_err(req, ENOENT);
-		return;
+		goto unlock;
 	}
 
-	usz child_id = ino_tab[ino].entries[ent_idx].id;
-	if (ino_tab[child_id].type == VI_REG) {
+	usz child_id = ino_tab(ino).entries[ent_idx].id;
+	if (ino_tab(child_id).type == VI_REG) {
 		fuse_reply_err(req, ENOTDIR);
-		return;
+		goto unlock;
+	}
+	if (inode_is_virtual(ino) || inode_is_virtual(child_id)) {
+		fuse_reply_err(req, EROFS);
+		goto unlock;
 	}
 
 	// this check is commented out because it causes problems when attempting to recreate a deleted
 	// directory. as this behaviour is inconsistent, the current approach should be revised.
-	//if (ino_tab[child_id].mod == output_mod) {
-		int res = unlinkat_nocase(output_mod->rootfd, ino_tab[child_id].real_path, AT_REMOVEDIR);
+	//if (ino_tab(child_id).mod == output_mod) {
+		int res = unlinkat_nocase(output_mod->rootfd, inode_path(child_id), AT_REMOVEDIR);
 		if (res < 0) {
 			fuse_reply_err(req, errno);
-			return;
+			goto unlock;
 		}
 	//}
 
 	inode_erase_dirent(ino, ent_idx);
+	dir_reclaim(ino);
 	fuse_reply_err(req, 0);
+
+unlock:
+	tree_unlock();
 }
 
 void vfs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+	dir_ensure_merged(ino);
+	tree_read_lock();
 	if (verbose)
-		lt_ierrf("vfs_opendir called for '%s'(%uq)\n", ino_tab[ino].real_path, ino);
+		lt_ierrf("vfs_opendir called for '%s'(%uq)\n", inode_path(ino), ino);
 
 	inode_open(ino);
 
 	fuse_reply_open(req, fi);
+	tree_unlock();
 }
 
 void vfs_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+	tree_read_lock();
 	if (verbose)
-		lt_ierrf("vfs_releasedir called for '%s'(%uq)\n", ino_tab[ino].real_path, ino);
+		lt_ierrf("vfs_releasedir called for '%s'(%uq)\n", inode_path(ino), ino);
 
-	inode_close(ino, 1);
+	if (!inode_put_shared(ino, 1, 0)) {
+		tree_unlock();
+		tree_write_lock();
+		inode_close(ino, 1);
+	}
 
 	fuse_reply_err(req, 0);
+	tree_unlock();
 }
 
 void vfs_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t off, off_t len, struct fuse_file_info* fi) {
-	lt_ferrf("vfs_fallocate called for '%s'(%uq)\n", ino_tab[ino].real_path, ino);
+	lt_ferrf("vfs_fallocate called for '%s'(%uq)\n", inode_path(ino), ino);
 	fuse_reply_err(req, EOPNOTSUPP);
 }
 
 
 void vfs_forget(fuse_req_t req, fuse_ino_t ino, u64 nlookup) {
+	tree_read_lock();
 	if (verbose)
-		lt_ierrf("vfs_forget called for '%s'(%uq)\n", ino_tab[ino].real_path, ino);
-	inode_forget(ino, nlookup);
-// 	lt_printf("'%s' allocated:%ub fds:%uz links:%uz lookups:%uz\n", ino_tab[ino].real_path, ino_tab[ino].allocated, ino_tab[ino].fds, ino_tab[ino].links, ino_tab[ino].lookups);
+		lt_ierrf("vfs_forget called for '%s'(%uq)\n", inode_path(ino), ino);
+	if (!inode_put_shared(ino, 0, nlookup)) {
+		tree_unlock();
+		tree_write_lock();
+		inode_forget(ino, nlookup);
+	}
+// 	lt_printf("'%s' allocated:%ub fds:%uz links:%uz lookups:%uz\n", inode_path(ino), ino_tab(ino).allocated, ino_tab(ino).fds, ino_tab(ino).links, ino_tab(ino).lookups);
 	fuse_reply_none(req);
+	tree_unlock();
 }
 
 void vfs_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data* forgets) {
+	tree_read_lock();
 	if (verbose)
 		lt_ierrf("vfs_forget_multi called with count %uz\n", count);
 
-	for (usz i = 0; i < count; ++i)
-		inode_forget(forgets[i].ino, forgets[i].nlookup);
+	// inodes that have to be freed are forgotten once the lock is held exclusively
+	usz* pending = NULL;
+	usz pending_count = 0;
+	for (usz i = 0; i < count; ++i) {
+		if (inode_put_shared(forgets[i].ino, 0, forgets[i].nlookup))
+			continue;
+		if (!pending) {
+			pending = lt_malloc(alloc, count * sizeof(usz));
+			LT_ASSERT(pending != NULL);
+		}
+		pending[pending_count++] = i;
+	}
+	tree_unlock();
+
+	if (pending) {
+		tree_write_lock();
+		for (usz i = 0; i < pending_count; ++i)
+			inode_forget(forgets[pending[i]].ino, forgets[pending[i]].nlookup);
+		tree_unlock();
+		lt_mfree(alloc, pending);
+	}
 	fuse_reply_none(req);
 }
 
 void vfs_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence, struct fuse_file_info* fi) {
 	if (verbose)
-		lt_ierrf("vfs_lseek called for '%s'(%uq)\n", ino_tab[ino].real_path, ino);
+		lt_ierrf("vfs_lseek called for '%s'(%uq)\n", inode_path(ino), ino);
+
+	vfs_file_t* file = fi_file(fi);
+
+	// cached and virtual files have no descriptor, and a lazy copy is sparse until it is
+	// finished. none of them have holes of their own, so everything up to the size is data.
+	if (file->data.str || file->cached || file->lazy) {
+		u64 size;
+		if (file->data.str)
+			size = file->data.len;
+		else if (file->cached)
+			size = filecache_size(file->cached);
+		else {
+			struct stat st;
+			if (fstat(file->fd, &st) < 0) {
+				fuse_reply_err(req, errno);
+				return;
+			}
+			size = st.st_size;
+		}
 
-	off_t res = lseek(fi->fh, off, whence);
-	if (res != -1)
+		if (whence != SEEK_DATA && whence != SEEK_HOLE)
+			fuse_reply_err(req, EINVAL);
+		else if (off < 0 || off >= size)
+			fuse_reply_err(req, ENXIO);
+		else
+			fuse_reply_lseek(req, whence == SEEK_DATA ? off : size);
+		return;
+	}
+
+	off_t res = lseek(file->fd, off, whence);
+	if (res == -1)
 		fuse_reply_err(req, errno);
 	else
 		fuse_reply_lseek(req, res);
@@ -1074,68 +2583,675 @@ struct fuse_args fuse_args;
 struct fuse_cmdline_opts fuse_opts;
 
 void vfs_thread_proc(void* mountpoint) {
-	int ret = fuse_session_loop(fuse_session);
+	int ret;
+	if (vfs_config.threads > 1) {
+		struct fuse_loop_config* loop_cfg = fuse_loop_cfg_create();
+		fuse_loop_cfg_set_max_threads(loop_cfg, vfs_config.threads);
+		fuse_loop_cfg_set_idle_threads(loop_cfg, vfs_config.threads);
+		ret = fuse_session_loop_mt(fuse_session, loop_cfg);
+		fuse_loop_cfg_destroy(loop_cfg);
+	}
+	else
+		ret = fuse_session_loop(fuse_session);
 	if (verbose)
 		lt_ierrf("libfuse thread returned %id\n", ret);
 }
 
 #include <libgen.h>
 
-void register_dirent(usz parent_id, mod_t* mod, char* real_path, lstr_t name, u32 type) {
-	usz child_id;
-	b8 free_path_late = 0;
+static
+void merge_conflict(path_node_t* path, char* what) {
+	// directories merged on demand are merged while mounted, where one bad entry should not end the session
+	if (!vfs_config.lazy_dirs)
+		lt_ferrf("incompatible mapping for '%s', cannot overwrite %s\n", path_str(path), what);
+	lt_werrf("incompatible mapping for '%s', cannot overwrite %s, entry ignored\n", path_str(path), what);
+}
 
-	switch (type) {
-	case DT_DIR:
-		child_id = inode_find_dirent(parent_id, name);
+// path nodes are never freed, so a name that is already in the directory with the same parent
+// node reuses the node of that entry instead of growing the arena every time a mod is merged.
+static
+path_node_t* path_for_child(usz parent_id, path_node_t* parent, lstr_t name) {
+	if (parent_id != ID_INVAL) {
+		usz child_id = inode_find_dirent(parent_id, name);
+		path_node_t* path = child_id != ID_INVAL ? ino_tab(child_id).path : NULL;
+		if (path && path->parent == parent && lt_lseq(path->name, name))
+			return path;
+	}
+	return path_new(parent, name);
+}
+
+// merge a single scanned entry into a directory, overriding a file registered by an earlier mod.
+// returns the inode the entry was merged into, or ID_INVAL if it had to be skipped.
+static
+usz merge_ent(mod_t* mod, usz parent_id, path_node_t* path, scan_ent_t* ent) {
+	// the path node's name doubles as the directory entry's name
+	lstr_t name = path->name;
+
+	usz child_id = inode_find_dirent(parent_id, name);
+	switch (ent->type) {
+	case VI_DIR:
 		if (child_id != ID_INVAL) {
-			if (ino_tab[child_id].type != VI_DIR)
-				lt_ferrf("incompatible mapping for '%s', cannot overwrite file with directory\n", real_path);
-			free_path_late = 1;
+			if (ino_tab(child_id).type != VI_DIR) {
+				merge_conflict(path, "file with directory");
+				return ID_INVAL;
+			}
+			return child_id;
+		}
+
+		child_id = inode_register(VI_DIR, mod, path);
+		inode_insert_dirent(child_id, CLSTR("."), child_id);
+		inode_insert_dirent(child_id, CLSTR(".."), parent_id);
+
+		dirent_push(parent_id, name, child_id);
+		if (ent->has_attr) {
+			ino_tab(child_id).attr = ent->attr;
+			ino_tab(child_id).attr_valid = 1;
+		}
+		ino_tab(child_id).unmerged = vfs_config.lazy_dirs;
+		return child_id;
+
+	case VI_REG:
+		if (child_id != ID_INVAL) {
+			if (ino_tab(child_id).type != VI_REG) {
+				merge_conflict(path, "directory with file");
+				return ID_INVAL;
+			}
+			ino_tab(child_id).mod = mod;
+			inode_set_path(child_id, path);
 		}
 		else {
-			child_id = inode_register(VI_DIR, mod, real_path);
-			inode_insert_dirent(child_id, CLSTR("."), child_id);
-			inode_insert_dirent(child_id, CLSTR(".."), parent_id);
+			child_id = inode_register(VI_REG, mod, path);
+			dirent_push(parent_id, name, child_id);
+		}
+
+		ino_tab(child_id).attr = ent->attr;
+		ino_tab(child_id).attr_valid = ent->has_attr;
+		return child_id;
+	}
+	return ID_INVAL;
+}
+
+// merge a mod's scan into the tree, overriding files registered by earlier mods
+void merge_scan(mod_t* mod, mod_scan_t* scan) {
+	usz* ids = lt_malloc(alloc, scan->ent_count * sizeof(usz));
+	LT_ASSERT(ids != NULL);
+	path_node_t** paths = lt_malloc(alloc, scan->ent_count * sizeof(path_node_t*));
+	LT_ASSERT(paths != NULL);
+
+	ids[0] = ID_ROOT;
+	paths[0] = &path_root;
+	if (mod == ino_tab(ID_ROOT).mod && scan->ents[0].has_attr) {
+		ino_tab(ID_ROOT).attr = scan->ents[0].attr;
+		ino_tab(ID_ROOT).attr_valid = 1;
+	}
+
+	for (usz i = 1; i < scan->ent_count; ++i) {
+		scan_ent_t* ent = &scan->ents[i];
+		path_node_t* path = path_for_child(ids[ent->parent], paths[ent->parent], scan_ent_name(scan, ent));
 
-			inode_insert_dirent(parent_id, name, child_id);
+		usz child_id = merge_ent(mod, ids[ent->parent], path, ent);
+		if (child_id != ID_INVAL && ent->type == VI_REG && scan->indexed)
+			ino_tab(child_id).attr_valid = 0;
+		if (ent->type == VI_DIR) {
+			ids[i] = child_id;
+			paths[i] = path;
 		}
+		else {
+			ids[i] = ID_INVAL;
+			paths[i] = NULL;
+		}
+	}
 
-		DIR* dir = fdopendir(openat(mod->rootfd, real_path, O_RDONLY));
-		LT_ASSERT(dir != NULL);
-		for (struct dirent* ent; (ent = readdir(dir));) {
-			if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
-				continue;
+	lt_mfree(alloc, paths);
+	lt_mfree(alloc, ids);
+}
+
+// with lazy_dirs enabled, a directory only records the mod directories it is made of
+// until its entries are first needed. merging one level at a time gives the same result
+// as merging whole scans, since each level is still merged in load order.
+
+static
+void dir_add_source(usz id, mod_t* mod, path_node_t* path) {
+	if (!ino_tab(id).sources)
+		ino_tab(id).sources = lt_darr_create(dir_src_t, 4, alloc);
+	dir_src_t src = { .mod = mod, .path = path };
+	lt_darr_push(ino_tab(id).sources, src);
+}
+
+// the tree lock must be held exclusively
+void dir_merge(usz id) {
+	vfs_inode_t* dir = &ino_tab(id);
+	if (!dir->unmerged)
+		return;
+
+	lt_darr(dir_src_t) sources = dir->sources;
+	dir->sources = NULL;
+
+	for (usz i = 0; sources && i < lt_darr_count(sources); ++i) {
+		dir_src_t* src = &sources[i];
+
+		mod_scan_t scan;
+		if (scan_mod_dir(src->mod, path_str(src->path), &scan) != LT_SUCCESS) {
+			lt_werrf("failed to list '%s' in mod '%S': %s\n", path_str(src->path), src->mod->name, lt_os_err_str());
+			continue;
+		}
 
-			char* child_path = lt_lsbuild(alloc, "%s/%s%c", real_path, ent->d_name, 0).str;
-			register_dirent(child_id, mod, child_path, lt_lsfroms(ent->d_name), ent->d_type);
+		if (src->mod == dir->mod && scan.ents[0].has_attr && !dir->attr_valid) {
+			dir->attr = scan.ents[0].attr;
+			dir->attr_valid = 1;
 		}
-		closedir(dir);
 
-		if (free_path_late)
-			lt_mfree(alloc, real_path);
+		for (usz j = 1; j < scan.ent_count; ++j) {
+			scan_ent_t* ent = &scan.ents[j];
+			path_node_t* path = path_for_child(id, src->path, scan_ent_name(&scan, ent));
+
+			usz child_id = merge_ent(src->mod, id, path, ent);
+			if (child_id != ID_INVAL && ino_tab(child_id).unmerged)
+				dir_add_source(child_id, src->mod, path);
+		}
+		scan_free(&scan);
+	}
+	if (sources)
+		lt_darr_destroy(sources);
+
+	dir_freeze(dir);
+	__atomic_store_n(&dir->unmerged, 0, __ATOMIC_RELEASE);
+}
+
+void dir_ensure_merged(usz id) {
+	if (!__atomic_load_n(&ino_tab(id).unmerged, __ATOMIC_ACQUIRE))
 		return;
+	tree_write_lock();
+	dir_merge(id);
+	tree_unlock();
+}
 
-	case DT_REG:
-		child_id = inode_find_dirent(parent_id, name);
-		if (child_id != ID_INVAL) {
-			if (ino_tab[child_id].type != VI_REG)
-				lt_ferrf("incompatible mapping for '%s', cannot overwrite directory with file\n", real_path);
-			ino_tab[child_id].mod = mod;
-			lt_mfree(alloc, real_path);
+// mods can be enabled, disabled and moved while mounted. only the paths the changed mod
+// contains are re-resolved, each of them belongs to the last mod in load order that has it.
+
+// the loopback mod is always first and the output mod always last
+static lt_darr(mod_t*) load_order = NULL;
+
+static
+isz order_find(lt_darr(mod_t*) order, mod_t* mod) {
+	for (usz i = 0; i < lt_darr_count(order); ++i) {
+		if (order[i] == mod)
+			return i;
+	}
+	return -1;
+}
+
+// returns a copy of path with the case it has in mod, or NULL if mod does not have it
+static
+char* mod_find_path(mod_t* mod, char* path, u8 type) {
+	struct stat st;
+	int res = fstatat(mod->rootfd, path, &st, AT_SYMLINK_NOFOLLOW);
+	b8 exact = res >= 0;
+	if (res < 0 && exact_path_missed(errno))
+		res = fstatat_nocase(mod->rootfd, path, &st, AT_SYMLINK_NOFOLLOW);
+	if (res < 0 || (type == VI_DIR) != !!S_ISDIR(st.st_mode))
+		return NULL;
+
+	usz len = strlen(path);
+	char* found = lt_malloc(alloc, len + 1);
+	LT_ASSERT(found != NULL);
+	memcpy(found, path, len + 1);
+	if (!exact && rebuild_path_case_at(mod->rootfd, found) < 0) {
+		lt_mfree(alloc, found);
+		return NULL;
+	}
+	return found;
+}
+
+// the mod that an entry of the changed mod belongs to after the change, and the entry's
+// path with the case it has in that mod. path is NULL when the owner is the changed mod.
+typedef
+struct remerge_owner {
+	b8 resolved;
+	mod_t* owner;
+	char* path;
+} remerge_owner_t;
+
+// find the mod that a file of the changed mod belongs to under order.
+// the previous owner was the last mod to have the file, so any mod that came after it
+// in the previous load order can be skipped without touching the disk.
+static
+void resolve_owner(mod_t* mod, mod_t* owner, char* path, lt_darr(mod_t*) order, lt_darr(mod_t*) old_order, remerge_owner_t* out) {
+	*out = (remerge_owner_t) { .resolved = 1, .owner = owner };
+
+	isz pos = order_find(order, mod);
+	if (owner != mod) {
+		if (pos > order_find(order, owner))
+			out->owner = mod;
+		return;
+	}
+
+	out->owner = NULL;
+	isz old_pos = order_find(old_order, mod);
+	for (isz i = lt_darr_count(order) - 1; i >= 0; --i) {
+		mod_t* it = order[i];
+		if (it == mod) {
+			out->owner = mod;
+			return;
 		}
-		else {
-			child_id = inode_register(VI_REG, mod, real_path);
-			inode_insert_dirent(parent_id, name, child_id);
+		if (order_find(old_order, it) > old_pos)
+			continue;
+		out->path = mod_find_path(it, path, VI_REG);
+		if (out->path) {
+			out->owner = it;
+			return;
+		}
+	}
+}
+
+// directories created by a disabled mod go to the first other mod that has them
+static
+void resolve_dir_owner(char* path, lt_darr(mod_t*) order, remerge_owner_t* out) {
+	*out = (remerge_owner_t) { .resolved = 1 };
+	for (usz i = 0; i < lt_darr_count(order) && !out->owner; ++i) {
+		out->path = mod_find_path(order[i], path, VI_DIR);
+		if (out->path)
+			out->owner = order[i];
+	}
+}
+
+// look up the new owner of everything the changed mod owns before the load order changes to order.
+// the tree is only read to find those entries, the disk is searched with no lock held.
+static
+remerge_owner_t* remerge_resolve(mod_t* mod, mod_scan_t* scan, lt_darr(mod_t*) order, lt_darr(mod_t*) old_order) {
+	b8 enabled = order_find(order, mod) >= 0;
+
+	remerge_owner_t* owners = lt_malloc(alloc, scan->ent_count * sizeof(remerge_owner_t));
+	LT_ASSERT(owners != NULL);
+	memset(owners, 0, scan->ent_count * sizeof(remerge_owner_t));
+	char** paths = lt_malloc(alloc, scan->ent_count * sizeof(char*));
+	LT_ASSERT(paths != NULL);
+	usz* ids = lt_malloc(alloc, scan->ent_count * sizeof(usz));
+	LT_ASSERT(ids != NULL);
+
+	ids[0] = ID_ROOT;
+	paths[0] = NULL;
+
+	tree_read_lock();
+	b8 root_merged = !__atomic_load_n(&ino_tab(ID_ROOT).unmerged, __ATOMIC_ACQUIRE);
+	for (usz i = 1; i < scan->ent_count; ++i) {
+		scan_ent_t* ent = &scan->ents[i];
+		usz parent_id = ids[ent->parent];
+		ids[i] = ID_INVAL;
+		paths[i] = NULL;
+		if (!root_merged || parent_id == ID_INVAL)
+			continue;
+
+		usz child_id = inode_find_dirent(parent_id, scan_ent_name(scan, ent));
+		if (child_id == ID_INVAL || ino_tab(child_id).type != ent->type)
+			continue;
+
+		vfs_inode_t* inode = &ino_tab(child_id);
+		if (ent->type == VI_DIR) {
+			if (__atomic_load_n(&inode->unmerged, __ATOMIC_ACQUIRE))
+				continue;
+			ids[i] = child_id;
+			if (enabled)
+				continue;
 		}
+		if (inode->mod != mod)
+			continue;
+
+		char* path = path_str(inode->path);
+		usz len = strlen(path);
+		paths[i] = lt_malloc(alloc, len + 1);
+		LT_ASSERT(paths[i] != NULL);
+		memcpy(paths[i], path, len + 1);
+	}
+	tree_unlock();
+
+	for (usz i = 1; i < scan->ent_count; ++i) {
+		if (!paths[i])
+			continue;
+		if (scan->ents[i].type == VI_DIR)
+			resolve_dir_owner(paths[i], order, &owners[i]);
+		else
+			resolve_owner(mod, mod, paths[i], order, old_order, &owners[i]);
+		lt_mfree(alloc, paths[i]);
+	}
+
+	lt_mfree(alloc, ids);
+	lt_mfree(alloc, paths);
+	return owners;
+}
+
+static
+void remerge_free(remerge_owner_t* owners, usz count) {
+	for (usz i = 0; i < count; ++i) {
+		if (owners[i].path)
+			lt_mfree(alloc, owners[i].path);
+	}
+	lt_mfree(alloc, owners);
+}
+
+// directories that are not merged yet only need their list of sources corrected
+static
+void dir_update_sources(usz id, mod_t* mod, path_node_t* path) {
+	for (usz i = 0; ino_tab(id).sources && i < lt_darr_count(ino_tab(id).sources); ++i) {
+		if (ino_tab(id).sources[i].mod == mod)
+			lt_darr_erase(ino_tab(id).sources, i--, 1);
+	}
+
+	isz pos = order_find(load_order, mod);
+	if (pos < 0)
 		return;
 
-	case DT_LNK:
-	default:
-		lt_werrf("unhandled file type for '%S', entry ignored\n", name);
-		lt_mfree(alloc, real_path);
+	dir_add_source(id, mod, path);
+	dir_src_t* sources = ino_tab(id).sources;
+	for (usz i = lt_darr_count(sources) - 1; i > 0 && order_find(load_order, sources[i - 1].mod) > pos; --i) {
+		dir_src_t tmp = sources[i];
+		sources[i] = sources[i - 1];
+		sources[i - 1] = tmp;
+	}
+}
+
+static
+void erase_child(usz parent_id, lstr_t name) {
+	isz idx = inode_find_dirent_index(parent_id, name);
+	if (idx == -1)
+		return;
+
+	// the entry's name is the one the kernel was told about, and lives as long as the mount
+	lstr_t ent_name = ino_tab(parent_id).entries[idx].name;
+	inode_erase_dirent(parent_id, idx);
+	dir_reclaim(parent_id);
+	notify_inval_entry(parent_id, ent_name);
+}
+
+static
+void change_owner(usz id, mod_t* owner, path_node_t* path) {
+	vfs_inode_t* inode = &ino_tab(id);
+	inode->mod = owner;
+	inode_set_path(id, path);
+	inode->attr_valid = 0;
+	inode->backing = NULL;
+	if (inode->type == VI_DIR)
+		dircache_drop(id);
+	else
+		filecache_drop(id);
+	notify_inval_inode(id);
+}
+
+// the path of an entry as the new owner has it, built from the changed mod's path
+static
+path_node_t* owner_path(path_node_t* path, remerge_owner_t* res) {
+	if (!res->path)
+		return path;
+	return path_with_case(path, res->path, res->path + strlen(res->path));
+}
+
+// re-resolve every path of a mod after the load order changed from old_order.
+// owners were looked up by remerge_resolve, entries that changed since then are looked up again.
+// the tree lock must be held exclusively.
+static
+void remerge_mod(mod_t* mod, mod_scan_t* scan, lt_darr(mod_t*) old_order, remerge_owner_t* owners) {
+	b8 enabled = order_find(load_order, mod) >= 0;
+
+	if (ino_tab(ID_ROOT).unmerged) {
+		dir_update_sources(ID_ROOT, mod, &path_root);
 		return;
 	}
+
+	usz* ids = lt_malloc(alloc, scan->ent_count * sizeof(usz));
+	LT_ASSERT(ids != NULL);
+	path_node_t** paths = lt_malloc(alloc, scan->ent_count * sizeof(path_node_t*));
+	LT_ASSERT(paths != NULL);
+
+	ids[0] = ID_ROOT;
+	paths[0] = &path_root;
+
+	for (usz i = 1; i < scan->ent_count; ++i) {
+		scan_ent_t* ent = &scan->ents[i];
+		usz parent_id = ids[ent->parent];
+		ids[i] = ID_INVAL;
+		paths[i] = NULL;
+		if (parent_id == ID_INVAL)
+			continue;
+
+		path_node_t* path = path_for_child(parent_id, paths[ent->parent], scan_ent_name(scan, ent));
+		paths[i] = path;
+
+		usz child_id = inode_find_dirent(parent_id, path->name);
+		if (child_id == ID_INVAL) {
+			if (!enabled)
+				continue;
+			child_id = merge_ent(mod, parent_id, path, ent);
+			if (child_id == ID_INVAL)
+				continue;
+			if (ino_tab(child_id).unmerged)
+				dir_add_source(child_id, mod, path);
+			else if (ent->type == VI_DIR)
+				ids[i] = child_id;
+			continue;
+		}
+
+		vfs_inode_t* inode = &ino_tab(child_id);
+		if (inode->type != ent->type) {
+			lt_werrf("incompatible mapping for '%s' in mod '%S', entry ignored\n", path_str(path), mod->name);
+			continue;
+		}
+
+		if (ent->type == VI_DIR) {
+			if (inode->unmerged)
+				dir_update_sources(child_id, mod, path);
+			else
+				ids[i] = child_id;
+			continue;
+		}
+
+		if (inode->mod == output_mod)
+			continue;
+
+		remerge_owner_t* res = &owners[i];
+		if (!res->resolved || inode->mod != mod) {
+			if (res->path)
+				lt_mfree(alloc, res->path);
+			resolve_owner(mod, inode->mod, path_str(path), load_order, old_order, res);
+		}
+
+		mod_t* owner = res->owner;
+		if (owner == inode->mod)
+			continue;
+
+		if (!owner) {
+			erase_child(parent_id, path->name);
+			continue;
+		}
+
+		change_owner(child_id, owner, owner_path(path, res));
+		if (owner == mod) {
+			inode->attr = ent->attr;
+			inode->attr_valid = ent->has_attr;
+		}
+	}
+
+	// directories created by a disabled mod go to the first other mod that has them,
+	// or are removed along with the mod's files. children are visited before their parents.
+	for (usz i = scan->ent_count; !enabled && i-- > 1;) {
+		usz id = ids[i];
+		if (id == ID_INVAL || ino_tab(id).mod != mod)
+			continue;
+
+		remerge_owner_t* res = &owners[i];
+		if (!res->resolved)
+			resolve_dir_owner(path_str(ino_tab(id).path), load_order, res);
+
+		if (res->owner)
+			change_owner(id, res->owner, owner_path(ino_tab(id).path, res));
+		else
+			erase_child(ids[scan->ents[i].parent], paths[i]->name);
+	}
+
+	lt_mfree(alloc, paths);
+	lt_mfree(alloc, ids);
+}
+
+// remove a mod from the load order and insert it again at pos, or not at all if pos is -1
+static
+lt_err_t mod_reorder(mod_t* mod, isz pos) {
+	mod_scan_t scan;
+	if (scan_mod(mod, &scan) != LT_SUCCESS)
+		return LT_ERR_UNKNOWN;
+
+	// the new order is built up front and swapped in under the exclusive lock,
+	// this is the only thread that changes it so it can be read here without the lock
+	lt_darr(mod_t*) old_order = load_order;
+	lt_darr(mod_t*) order = lt_darr_create(mod_t*, lt_darr_count(old_order), alloc);
+	lt_darr_insert(order, 0, old_order, lt_darr_count(old_order));
+
+	isz old_pos = order_find(order, mod);
+	if (old_pos >= 0)
+		lt_darr_erase(order, old_pos, 1);
+
+	// mods always stay between the loopback and output mods
+	if (pos >= 0) {
+		usz last = lt_darr_count(order) - 1;
+		usz at = pos == 0 || (usz)pos > last ? last : (usz)pos;
+		lt_darr_insert(order, at, &mod, 1);
+	}
+
+	remerge_owner_t* owners = remerge_resolve(mod, &scan, order, old_order);
+
+	tree_write_lock();
+	load_order = order;
+	remerge_mod(mod, &scan, old_order, owners);
+	tree_unlock();
+
+	remerge_free(owners, scan.ent_count);
+	lt_darr_destroy(old_order);
+	scan_free(&scan);
+	return LT_SUCCESS;
+}
+
+usz vfs_mod_count(void) {
+	return lt_darr_count(load_order) - 2;
+}
+
+mod_t* vfs_mod_at(usz pos) {
+	LT_ASSERT(pos >= 1 && pos <= vfs_mod_count());
+	return load_order[pos];
+}
+
+lt_err_t vfs_mod_enable(mod_t* mod, usz pos) {
+	if (order_find(load_order, mod) >= 0 || mod == output_mod)
+		return LT_ERR_EXISTS;
+	return mod_reorder(mod, pos);
+}
+
+lt_err_t vfs_mod_disable(mod_t* mod) {
+	if (order_find(load_order, mod) < 0 || mod == loopback_mod || mod == output_mod)
+		return LT_ERR_NOT_FOUND;
+	return mod_reorder(mod, -1);
+}
+
+lt_err_t vfs_mod_move(mod_t* mod, usz pos) {
+	if (order_find(load_order, mod) < 0 || mod == loopback_mod || mod == output_mod)
+		return LT_ERR_NOT_FOUND;
+	return mod_reorder(mod, pos);
+}
+
+// the mounted vfs is described to control clients and in .LMODORG/stats as lines of 'key value' pairs
+
+static char* mount_path = NULL;
+static u64 mount_time = 0;
+
+static
+u64 time_sec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static
+void out_line(lt_darr(char)* out, lstr_t line) {
+	lt_darr_insert(*out, lt_darr_count(*out), line.str, line.len);
+	lt_mfree(alloc, line.str);
+}
+
+static
+lstr_t out_finish(lt_darr(char) out) {
+	lstr_t str = lt_strdup(alloc, LSTR(out, lt_darr_count(out)));
+	lt_darr_destroy(out);
+	return str;
+}
+
+// the load order is only changed from the control thread, which is also the one calling this
+lstr_t vfs_status(void) {
+	lt_darr(char) out = lt_darr_create(char, 1024, alloc);
+	LT_ASSERT(out != NULL);
+
+	out_line(&out, lt_lsbuild(alloc, "pid %ud\n", getpid()));
+	out_line(&out, lt_lsbuild(alloc, "mountpoint %s\n", mount_path));
+	out_line(&out, lt_lsbuild(alloc, "uptime %uq\n", time_sec() - mount_time));
+	out_line(&out, lt_lsbuild(alloc, "passthrough %ud\n", passthrough_on()));
+	out_line(&out, lt_lsbuild(alloc, "writeback %ud\n", writeback_active));
+	out_line(&out, lt_lsbuild(alloc, "lazy_dirs %ud\n", vfs_config.lazy_dirs));
+	out_line(&out, lt_lsbuild(alloc, "max_write %ud\n", conn_max_write));
+	out_line(&out, lt_lsbuild(alloc, "max_readahead %ud\nmax_background %ud\n", conn_max_readahead, conn_max_background));
+
+	usz mod_count = vfs_mod_count();
+	out_line(&out, lt_lsbuild(alloc, "mods %uz\n", mod_count));
+	for (usz i = 1; i <= mod_count; ++i)
+		out_line(&out, lt_lsbuild(alloc, "mod %uz %S\n", i, vfs_mod_at(i)->name));
+
+	return out_finish(out);
+}
+
+// the tree lock must be held
+static
+lstr_t build_stats(void) {
+	lt_darr(char) out = lt_darr_create(char, 4096, alloc);
+	LT_ASSERT(out != NULL);
+
+	usz inodes = 0, dirs = 0, open_files = 0;
+	for (usz id = ID_ROOT; id < ino_page_count * INO_PAGE_SIZE; ++id) {
+		vfs_inode_t* inode = &ino_tab(id);
+		if (!inode->allocated)
+			continue;
+		++inodes;
+		dirs += inode->type == VI_DIR;
+		open_files += inode->type != VI_DIR && inode->fds;
+	}
+
+	out_line(&out, lt_lsbuild(alloc, "inodes %uz\n", inodes));
+	out_line(&out, lt_lsbuild(alloc, "directories %uz\n", dirs));
+	out_line(&out, lt_lsbuild(alloc, "open_files %uz\n", open_files));
+	out_line(&out, lt_lsbuild(alloc, "shared_fds %uz\n", __atomic_load_n(&shared_fd_count, __ATOMIC_RELAXED)));
+	out_line(&out, lt_lsbuild(alloc, "name_bytes %uz\n", name_arena.total));
+
+	usz hits, misses, count, max;
+	dircache_get_stats(&hits, &misses, &count, &max);
+	out_line(&out, lt_lsbuild(alloc, "dircache_hits %uz\ndircache_misses %uz\ndircache_fds %uz\ndircache_max %uz\n", hits, misses, count, max));
+	filecache_get_stats(&hits, &misses, &count, &max);
+	out_line(&out, lt_lsbuild(alloc, "filecache_hits %uz\nfilecache_misses %uz\nfilecache_bytes %uz\nfilecache_capacity %uz\n", hits, misses, count, max));
+
+	opstats_write(&out);
+
+	// reads that go through passthrough never reach the vfs, and are not counted
+	for (usz i = 0; i < lt_darr_count(load_order); ++i) {
+		mod_t* mod = load_order[i];
+		u64 read = __atomic_load_n(&mod->bytes_read, __ATOMIC_RELAXED);
+		u64 written = __atomic_load_n(&mod->bytes_written, __ATOMIC_RELAXED);
+		out_line(&out, lt_lsbuild(alloc, "mod_bytes %uq %uq %S\n", read, written, mod->name));
+	}
+
+	return out_finish(out);
+}
+
+lstr_t vfs_stats(void) {
+	tree_read_lock();
+	lstr_t stats = build_stats();
+	tree_unlock();
+	return stats;
+}
+
+b8 vfs_exited(void) {
+	return fuse_session_exited(fuse_session);
 }
 
 void print_debug_stat(usz id) {
@@ -1143,9 +3259,9 @@ void print_debug_stat(usz id) {
 }
 
 void print_debug_ls(usz id) {
-	vfs_inode_t* inode = &ino_tab[id];
+	vfs_inode_t* inode = &ino_tab(id);
 
-	lt_printf("listing files in [%S] '%s'(%uq):\n", inode->mod->name, inode->real_path, id);
+	lt_printf("listing files in [%S] '%s'(%uq):\n", inode->mod->name, path_str(inode->path), id);
 
 	if (inode->type != VI_DIR) {
 		lt_printf("\tfailed; not a directory\n");
@@ -1154,21 +3270,104 @@ void print_debug_ls(usz id) {
 
 	for (usz i = 0; i < lt_darr_count(inode->entries); ++i) {
 		usz entid = inode->entries[i].id;
-		vfs_inode_t* ent = &ino_tab[entid];
+		vfs_inode_t* ent = &ino_tab(entid);
 		lt_printf("\t%_6uz %_14S %S\n", entid, ent->mod->name, inode->entries[i].name);
 	}
 }
 
+// scan mods, reusing the index for any mod whose directories did not change
+static
+void scan_and_merge(lt_darr(mod_t*) mods) {
+	usz scan_count = lt_darr_count(mods) + 1;
+	mod_t** scan_mods = lt_malloc(alloc, scan_count * sizeof(mod_t*));
+	LT_ASSERT(scan_mods != NULL);
+	mod_scan_t* scans = lt_malloc(alloc, scan_count * sizeof(mod_scan_t));
+	LT_ASSERT(scans != NULL);
+
+	scan_mods[0] = loopback_mod;
+	for (usz i = 0; i < lt_darr_count(mods); ++i) {
+		LT_ASSERT(mods[i]->rootfd >= 0);
+		scan_mods[i + 1] = mods[i];
+	}
+
+	vfs_index_t index = { 0 };
+	b8 have_index = 0;
+	if (vfs_config.index_path && !vfs_config.rescan) {
+		lt_err_t err = index_load(vfs_config.index_path, &index);
+		have_index = err == LT_SUCCESS;
+		if (err != LT_SUCCESS && err != LT_ERR_NOT_FOUND)
+			lt_werrf("failed to load vfs index '%s', rescanning all mods\n", vfs_config.index_path);
+	}
+
+	scan_job_t* jobs = lt_malloc(alloc, scan_count * sizeof(scan_job_t));
+	LT_ASSERT(jobs != NULL);
+	for (usz i = 0; i < scan_count; ++i) {
+		jobs[i] = (scan_job_t) {
+				.mod = scan_mods[i],
+				.scan = &scans[i] };
+		jobs[i].reused = have_index && index_find(&index, scan_mods[i]->name, &scans[i]);
+	}
+
+	scan_mods_parallel(jobs, scan_count, vfs_config.scan_threads);
+
+	b8 index_dirty = !have_index;
+	for (usz i = 0; i < scan_count; ++i) {
+		if (jobs[i].reused) {
+			if (verbose)
+				lt_ierrf("loaded mod '%S' from index in %uq ms\n", scan_mods[i]->name, jobs[i].usec / 1000);
+			continue;
+		}
+
+		if (jobs[i].err != LT_SUCCESS)
+			lt_ferrf("failed to scan mod '%S'\n", scan_mods[i]->name);
+		if (verbose)
+			lt_ierrf("scanned mod '%S' in %uq ms, %uz entries\n", scan_mods[i]->name, jobs[i].usec / 1000, scans[i].ent_count);
+		index_dirty = 1;
+	}
+	lt_mfree(alloc, jobs);
+
+	// merging in load order makes later mods override earlier ones
+	for (usz i = 0; i < scan_count; ++i)
+		merge_scan(scan_mods[i], &scans[i]);
+
+	// mod entries do not change after this point, output entries go into the overlay
+	usz frozen = 0;
+	for (usz id = ID_ROOT; id < ino_page_count * INO_PAGE_SIZE; ++id) {
+		if (ino_tab(id).allocated && ino_tab(id).type == VI_DIR)
+			frozen += dir_freeze(&ino_tab(id));
+	}
+	if (verbose) {
+		lt_ierrf("froze %uz directories into perfect hash tables\n", frozen);
+		lt_ierrf("%uz KiB of names and paths\n", name_arena.total / 1024);
+	}
+
+	if (vfs_config.index_path && index_dirty) {
+		if (index_write(vfs_config.index_path, scan_mods, scans, scan_count) != LT_SUCCESS)
+			lt_werrf("failed to write vfs index '%s': %s\n", vfs_config.index_path, lt_os_err_str());
+	}
+
+	for (usz i = 0; i < scan_count; ++i)
+		scan_free(&scans[i]);
+	index_unload(&index);
+	lt_mfree(alloc, scans);
+	lt_mfree(alloc, scan_mods);
+}
+
 void vfs_mount(char* argv0_, char* mountpoint, lt_darr(mod_t*) mods, char* output_path) {
 	argv0 = argv0_;
 
-#define INO_TABSZ 65535
-
 	// initialize inode table
-	ino_tab = lt_darr_create(vfs_inode_t, INO_TABSZ, alloc);
-	ino_tab = lt_darr_make_space(ino_tab, INO_TABSZ);
-	memset(ino_tab, 0, sizeof(vfs_inode_t) * INO_TABSZ);
+	ino_page_count = 0;
 	inode_id_free = ID_INVAL;
+	inode_grow();
+
+	dircache_init(vfs_config.dirfd_cache_size);
+	filecache_init(vfs_config.file_cache_size);
+	opstats_init(vfs_config.op_stats);
+	arena_init(&name_arena, LT_MB(1));
+
+	for (usz i = 0; i < INO_LOCK_COUNT; ++i)
+		pthread_mutex_init(&ino_locks[i], NULL);
 
 	// create loopback mod
 
@@ -1182,26 +3381,22 @@ void vfs_mount(char* argv0_, char* mountpoint, lt_darr(mod_t*) mods, char* outpu
 			.rootfd = loopback_fd };
 	mod_register(loopback_mod);
 
-	ino_tab[ID_ROOT + 1].next_id = ID_INVAL;
-	for (usz i = ID_ROOT + 2; i < lt_darr_count(ino_tab); ++i)
-		ino_tab[i].next_id = i - 1;
-	inode_id_free = INO_TABSZ - 1;
-
-	inode_register_at(ID_ROOT, VI_DIR, loopback_mod, strdup("."));
+	inode_register_at(ID_ROOT, VI_DIR, loopback_mod, &path_root);
+	ino_tab(ID_ROOT).parent = ID_ROOT;
 	inode_insert_dirent(ID_ROOT, CLSTR("."), ID_ROOT);
 	inode_insert_dirent(ID_ROOT, CLSTR(".."), ID_ROOT); // !! incorrect inode
-	register_dirent(ID_ROOT, loopback_mod, strdup("."), CLSTR("."), DT_DIR);
-
-	// register mods
 
-	for (usz i = 0; i < lt_darr_count(mods); ++i) {
-		int fd = mods[i]->rootfd;
-		LT_ASSERT(fd >= 0);
-
-		if (verbose)
-			lt_ierrf("loading mod '%S'\n", mods[i]->name);
-		register_dirent(ID_ROOT, mods[i], strdup("."), CLSTR("."), DT_DIR);
+	if (vfs_config.lazy_dirs) {
+		// nothing is scanned up front, the root only records the mods it is made of
+		ino_tab(ID_ROOT).unmerged = 1;
+		dir_add_source(ID_ROOT, loopback_mod, &path_root);
+		for (usz i = 0; i < lt_darr_count(mods); ++i) {
+			LT_ASSERT(mods[i]->rootfd >= 0);
+			dir_add_source(ID_ROOT, mods[i], &path_root);
+		}
 	}
+	else
+		scan_and_merge(mods);
 
 	// create output mod
 
@@ -1215,12 +3410,41 @@ void vfs_mount(char* argv0_, char* mountpoint, lt_darr(mod_t*) mods, char* outpu
 			.rootfd = output_fd };
 	mod_register(output_mod);
 
-	register_dirent(ID_ROOT, output_mod, strdup("."), CLSTR("."), DT_DIR);
+	// the output directory is written to during play, so it is never taken from the index
+	if (vfs_config.lazy_dirs)
+		dir_add_source(ID_ROOT, output_mod, &path_root);
+	else {
+		mod_scan_t output_scan;
+		if (scan_mod(output_mod, &output_scan) != LT_SUCCESS)
+			lt_ferrf("failed to scan output directory '%s': %s\n", output_path, lt_os_err_str());
+		merge_scan(output_mod, &output_scan);
+		scan_free(&output_scan);
+	}
+
+	load_order = lt_darr_create(mod_t*, lt_darr_count(mods) + 2, alloc);
+	lt_darr_push(load_order, loopback_mod);
+	for (usz i = 0; i < lt_darr_count(mods); ++i)
+		lt_darr_push(load_order, mods[i]);
+	lt_darr_push(load_order, output_mod);
+
+	// a mod that ships its own .LMODORG hides the generated files
+	dir_ensure_merged(ID_ROOT);
+	if (inode_find_dirent(ID_ROOT, CLSTR(".LMODORG")) == ID_INVAL) {
+		usz lmodorg_id = virtual_register(ID_ROOT, VI_DIR, CLSTR(".LMODORG"));
+		virtual_register(lmodorg_id, VI_REG, CLSTR("stats"));
+	}
 
 	print_debug_ls(ID_ROOT);
 
-	char* fuse_argv[] = { argv0, mountpoint, "-f", NULL, };
-	int fuse_argc = sizeof(fuse_argv) / sizeof(*fuse_argv) - 1;
+	// the kernel only honors max_read when it is also given as a mount option
+	char* max_read_opt = NULL;
+	char* fuse_argv[] = { argv0, mountpoint, "-f", NULL, NULL, NULL, };
+	int fuse_argc = 3;
+	if (vfs_config.max_read) {
+		max_read_opt = lt_lsbuild(alloc, "max_read=%uz%c", vfs_config.max_read, 0).str;
+		fuse_argv[fuse_argc++] = "-o";
+		fuse_argv[fuse_argc++] = max_read_opt;
+	}
 
 	fuse_args = (struct fuse_args)FUSE_ARGS_INIT(fuse_argc, fuse_argv);
 	if (fuse_parse_cmdline(&fuse_args, &fuse_opts) != 0)
@@ -1229,6 +3453,11 @@ void vfs_mount(char* argv0_, char* mountpoint, lt_darr(mod_t*) mods, char* outpu
 	fuse_session = fuse_session_new(&fuse_args, &fuse_oper, sizeof(fuse_oper), NULL);
 	if (fuse_session == NULL)
 		lt_ferrf("failed to create libfuse session\n");
+	lt_mfree(alloc, max_read_opt);
+
+	notify_init(fuse_session);
+	negcache_init();
+	lazy_thread_start();
 
 	if (fuse_set_signal_handlers(fuse_session) != 0)
 		lt_ferrf("failed to set libfuse signal handlers\n");
@@ -1239,6 +3468,14 @@ void vfs_mount(char* argv0_, char* mountpoint, lt_darr(mod_t*) mods, char* outpu
 	vfs_thread = lt_thread_create(vfs_thread_proc, mountpoint, alloc);
 	if (!vfs_thread)
 		lt_ferrf("failed to create thread\n");
+	mount_path = mountpoint;
+	mount_time = time_sec();
+
+	// prefetch what the last session read while starting up, and record it again for the next one
+	if (vfs_config.trace_path) {
+		trace_replay_start(vfs_config.trace_path);
+		trace_record_start(vfs_config.trace_time);
+	}
 }
 
 void vfs_unmount(void) {
@@ -1248,6 +3485,16 @@ void vfs_unmount(void) {
 		;
 	vfs_thread = NULL;
 
+	negcache_terminate();
+	notify_terminate();
+	lazy_thread_stop();
+
+	if (vfs_config.trace_path) {
+		trace_replay_stop();
+		if (trace_write(vfs_config.trace_path) != LT_SUCCESS)
+			lt_werrf("failed to write boot trace '%s': %s\n", vfs_config.trace_path, lt_os_err_str());
+	}
+
 	fuse_session_unmount(fuse_session);
 	fuse_remove_signal_handlers(fuse_session);
 	fuse_session_destroy(fuse_session);
@@ -1258,6 +3505,20 @@ void vfs_unmount(void) {
 	if (verbose)
 		lt_ierrf("freeing file tree\n");
 	inode_force_free(ID_ROOT);
+	path_repairs_discard();
+	arena_free(&name_arena);
+	lt_darr_destroy(load_order);
+	load_order = NULL;
+
+	if (verbose) {
+		dircache_print_stats();
+		filecache_print_stats();
+	}
+	dircache_terminate();
+	filecache_terminate();
 
-	lt_darr_destroy(ino_tab);
+	for (usz i = 0; i < ino_page_count; ++i)
+		lt_mfree(alloc, ino_pages[i]);
+	ino_page_count = 0;
+	inode_id_free = ID_INVAL;
 }
@@ -4,6 +4,8 @@
 #include <lt/fwd.h>
 #include <lt/err.h>
 
+#include <time.h>
+
 #define VI_REG	0
 #define VI_DIR	1
 #define VI_LNK	2
@@ -13,9 +15,44 @@ typedef struct avail_mod avail_mod_t;
 
 typedef struct vfs_inode vfs_inode_t;
 
+typedef
+struct path_node {
+	struct path_node* parent;
+	lstr_t name;
+} path_node_t;
+
+// a mod directory that is merged into a virtual directory
+typedef
+struct dir_src {
+	mod_t* mod;
+	path_node_t* path;
+} dir_src_t;
+
+typedef struct lazy_file lazy_file_t;
+typedef struct filecache_ent filecache_ent_t;
+
+// a read-only backing file shared by every read-only open of an inode.
+// reads always pass an offset, so the descriptor's own position is never used.
+typedef
+struct vfs_backing {
+	int fd;
+	int backing_id;
+	u32 refs;
+} vfs_backing_t;
+
+typedef
+struct vfs_attr {
+	u64 size;
+	u64 blocks;
+	struct timespec atime;
+	struct timespec mtime;
+	struct timespec ctime;
+} vfs_attr_t;
+
 typedef
 struct vfs_dirent {
 	b8 present;
+	u32 hash;
 	lstr_t name;
 	char* cname;
 	usz id;
@@ -32,9 +69,27 @@ struct  vfs_inode {
 			u32 fds;
 			u32 lookups;
 			lt_darr(vfs_dirent_t) entries;
+			u32* hashtab;
+			u32 hashtab_size;
+			u32 base_count;
+			u32 base_erased;
+			u32 erased;
+			u32 mph_buckets;
+			u16* mph_disp;
+			u32* mph_slots;
+
+			b8 unmerged;
+			lt_darr(dir_src_t) sources;
 
 			mod_t* mod;
-			char* real_path;
+			path_node_t* path;
+			usz parent;
+
+			b8 attr_valid;
+			vfs_attr_t attr;
+
+			lazy_file_t* lazy;
+			vfs_backing_t* backing;
 		};
 
 		usz next_id;
@@ -50,10 +105,59 @@ struct  vfs_inode {
 
 typedef i64 vfs_fd_t;
 
+typedef
+struct vfs_file {
+	int fd;
+	int backing_id;
+	lazy_file_t* lazy;
+	filecache_ent_t* cached;
+	vfs_backing_t* shared;
+	lstr_t data;
+
+	// copied from the inode when opened, reads and writes run without the tree lock
+	mod_t* mod;
+	path_node_t* path;
+	b8 fixed_size;
+	u64 size;
+} vfs_file_t;
+
+typedef
+struct vfs_config {
+	usz dirfd_cache_size;
+	usz threads;
+	b8 passthrough;
+	u64 lazy_copy_size;
+	usz negative_timeout;
+	usz scan_threads;
+	char* index_path;
+	b8 rescan;
+	b8 lazy_dirs;
+	char* trace_path;
+	usz trace_time;
+	usz file_cache_size;
+	usz file_cache_max;
+	usz shared_fd_max;
+	b8 keep_cache;
+	b8 writeback_cache;
+	usz mod_cache_timeout;
+	usz output_cache_timeout;
+	usz max_read;
+	usz max_write;
+	usz max_readahead;
+	usz max_background;
+	usz congestion_threshold;
+	b8 op_stats;
+} vfs_config_t;
+
+extern vfs_config_t vfs_config;
+
 u64 new_inode_id(void);
 
 lt_err_t inode_insert_dirent(usz parent_id, lstr_t name, usz child_id);
-usz inode_register(u8 type, mod_t* mod, char* path);
+usz inode_register(u8 type, mod_t* mod, path_node_t* path);
+
+path_node_t* path_new(path_node_t* parent, lstr_t name);
+char* path_str(path_node_t* node);
 
 vfs_inode_t* inode_find_by_id(usz ino);
 usz inode_find_dirent(usz parent_id, lstr_t name);
@@ -63,5 +167,21 @@ void vfs_thread_proc(void* mountpoint);
 void vfs_mount(char* argv0_, char* mountpoint, lt_darr(mod_t*) avail_mod_t, char* output_path);
 void vfs_unmount(void);
 
+// change the load order of the mounted vfs, only the paths of the given mod are re-resolved.
+// positions count from 1, enabling or moving a mod to position 0 puts it last.
+// the load order is only changed from the control thread.
+usz vfs_mod_count(void);
+mod_t* vfs_mod_at(usz pos);
+lt_err_t vfs_mod_enable(mod_t* mod, usz pos);
+lt_err_t vfs_mod_disable(mod_t* mod);
+lt_err_t vfs_mod_move(mod_t* mod, usz pos);
+
+// describe the mounted vfs as lines of 'key value' pairs
+lstr_t vfs_status(void);
+lstr_t vfs_stats(void);
+
+// true once the session ended, either through unmounting or a signal
+b8 vfs_exited(void);
+
 
 #endif
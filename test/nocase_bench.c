@@ -0,0 +1,167 @@
+#include <lt/io.h>
+#include <lt/mem.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+// the kernels are static, so they are built into the benchmark directly
+#include "../src/nocase.c"
+
+#define alloc lt_libc_heap
+
+// compares the case-insensitive compare and hash kernels against the byte-at-a-time
+// lt_lseq_nocase and fnv-1a that were used before.
+//
+//   nocase_bench [ROUNDS]
+//
+// names are generated with the lengths and character mix of typical mod file paths,
+// half of the compared pairs differ only in case and the other half differ in their last byte.
+
+#define NAME_COUNT 4096
+#define MAX_NAME_LEN 96
+
+typedef
+struct bench_pair {
+	lstr_t a;
+	lstr_t b;
+} bench_pair_t;
+
+static bench_pair_t pairs[NAME_COUNT];
+
+static volatile u64 sink;
+
+static
+u64 time_nsec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static
+u64 rand_next(u64* state) {
+	u64 x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+static
+u8 to_lower(u8 c) {
+	if (c >= 'A' && c <= 'Z')
+		return c + ('a' - 'A');
+	return c;
+}
+
+static
+b8 lseq_nocase_bytes(lstr_t a, lstr_t b) {
+	if (a.len != b.len)
+		return 0;
+	for (usz i = 0; i < a.len; ++i) {
+		if (to_lower(a.str[i]) != to_lower(b.str[i]))
+			return 0;
+	}
+	return 1;
+}
+
+static
+u32 hash_nocase_fnv(lstr_t str) {
+	u32 hash = 2166136261;
+	for (usz i = 0; i < str.len; ++i) {
+		u8 c = to_lower(str.str[i]);
+		hash = (hash ^ c) * 16777619;
+	}
+	return hash;
+}
+
+static
+void gen_pairs(void) {
+	static char chars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-. ";
+
+	u64 rng = 1;
+	for (usz i = 0; i < NAME_COUNT; ++i) {
+		// most names are short, a few are long paths
+		usz len = 4 + rand_next(&rng) % 28;
+		if (rand_next(&rng) % 8 == 0)
+			len = 32 + rand_next(&rng) % (MAX_NAME_LEN - 32);
+
+		char* a = lt_malloc(alloc, len);
+		char* b = lt_malloc(alloc, len);
+		LT_ASSERT(a != NULL && b != NULL);
+		for (usz j = 0; j < len; ++j) {
+			a[j] = chars[rand_next(&rng) % (sizeof(chars) - 1)];
+			b[j] = rand_next(&rng) % 2 ? to_lower(a[j]) : a[j];
+		}
+		if (i % 2)
+			b[len - 1] ^= 1;
+
+		pairs[i] = (bench_pair_t) { LSTR(a, len), LSTR(b, len) };
+	}
+}
+
+static
+void bench_lseq(char* name, b8 (*fn)(lstr_t, lstr_t), usz rounds) {
+	u64 res = 0;
+	u64 start = time_nsec();
+	for (usz r = 0; r < rounds; ++r) {
+		for (usz i = 0; i < NAME_COUNT; ++i)
+			res += fn(pairs[i].a, pairs[i].b);
+	}
+	u64 ns = time_nsec() - start;
+	sink = res;
+
+	lt_printf("lseq %s: %uq ps/call\n", name, ns * 1000 / (rounds * NAME_COUNT));
+}
+
+static
+void bench_hash(char* name, u32 (*fn)(lstr_t), usz rounds) {
+	u64 res = 0;
+	u64 start = time_nsec();
+	for (usz r = 0; r < rounds; ++r) {
+		for (usz i = 0; i < NAME_COUNT; ++i)
+			res += fn(pairs[i].a);
+	}
+	u64 ns = time_nsec() - start;
+	sink = res;
+
+	lt_printf("hash %s: %uq ps/call\n", name, ns * 1000 / (rounds * NAME_COUNT));
+}
+
+int main(int argc, char** argv) {
+	if (argc > 2)
+		lt_ferrf("usage: %s [ROUNDS]\n", argv[0]);
+	usz rounds = argc > 1 ? strtoul(argv[1], NULL, 10) : 2000;
+	if (!rounds)
+		lt_ferrf("round count must be at least 1\n");
+
+	gen_pairs();
+
+	// every kernel must agree with the old comparison
+	for (usz i = 0; i < NAME_COUNT; ++i) {
+		b8 expect = lseq_nocase_bytes(pairs[i].a, pairs[i].b);
+		if (lseq_nocase_scalar(pairs[i].a, pairs[i].b) != expect || lseq_nocase(pairs[i].a, pairs[i].b) != expect)
+			lt_ferrf("kernels disagree on pair %uz\n", i);
+		if (hash_nocase_scalar(pairs[i].a) != hash_nocase(pairs[i].a))
+			lt_ferrf("hash kernels disagree on pair %uz\n", i);
+	}
+
+	b8 avx2 = lseq_nocase == lseq_nocase_avx2;
+	lt_printf("%uz names, %uz rounds, avx2 %s\n", (usz)NAME_COUNT, rounds, avx2 ? "available" : "not available");
+
+	bench_lseq("bytes", lseq_nocase_bytes, rounds);
+	bench_lseq("scalar", lseq_nocase_scalar, rounds);
+	if (avx2)
+		bench_lseq("avx2", lseq_nocase_avx2, rounds);
+
+	bench_hash("fnv-1a", hash_nocase_fnv, rounds);
+	bench_hash("scalar", hash_nocase_scalar, rounds);
+	if (avx2)
+		bench_hash("avx2", hash_nocase_avx2, rounds);
+
+	for (usz i = 0; i < NAME_COUNT; ++i) {
+		lt_mfree(alloc, pairs[i].a.str);
+		lt_mfree(alloc, pairs[i].b.str);
+	}
+	return 0;
+}
@@ -0,0 +1,284 @@
+#include <lt/mem.h>
+#include <lt/io.h>
+#include <lt/thread.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define alloc lt_libc_heap
+
+// concurrent read and write stress test for a mounted vfs.
+//
+//   stress DIR [THREADS] [SECONDS]
+//
+// every regular file in DIR is loaded into memory first, then each thread keeps opening,
+// reading and rewriting random ranges of them. writes put back the bytes that were already
+// there, so files of mods are redirected to the output directory while other threads are
+// still reading them, and every read can be checked against the original contents.
+// if DIR holds no files, a few are created in it.
+
+#define MAX_FILES 256
+#define MAX_TOTAL_SIZE LT_MB(512)
+#define MAX_RANGE LT_KB(256)
+
+#define CREATE_COUNT 8
+#define CREATE_SIZE LT_MB(4)
+
+typedef
+struct stress_file {
+	char* path;
+	char* data;
+	usz size;
+} stress_file_t;
+
+static stress_file_t files[MAX_FILES];
+static usz file_count = 0;
+
+static u64 deadline = 0;
+
+static u64 reads = 0;
+static u64 writes = 0;
+static u64 failures = 0;
+
+static
+u64 time_msec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static
+u64 rand_next(u64* state) {
+	u64 x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+static
+void fail(stress_file_t* file, char* what) {
+	lt_werrf("%s failed for '%s': %s\n", what, file->path, strerror(errno));
+	__atomic_fetch_add(&failures, 1, __ATOMIC_RELAXED);
+}
+
+static
+isz read_full(int fd, char* buf, usz size, u64 off) {
+	usz total = 0;
+	while (total < size) {
+		isz res = pread(fd, buf + total, size - total, off + total);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res < 0)
+			return -1;
+		if (res == 0)
+			break;
+		total += res;
+	}
+	return total;
+}
+
+static
+void check_read(stress_file_t* file, u64 off, usz size, char* buf) {
+	int fd = open(file->path, O_RDONLY);
+	if (fd < 0) {
+		fail(file, "open");
+		return;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+		fail(file, "fstat");
+	else if (st.st_size != file->size) {
+		lt_werrf("'%s' has a size of %uq bytes, expected %uz\n", file->path, (u64)st.st_size, file->size);
+		__atomic_fetch_add(&failures, 1, __ATOMIC_RELAXED);
+	}
+
+	isz res = read_full(fd, buf, size, off);
+	if (res < 0)
+		fail(file, "read");
+	else if (res != size || memcmp(buf, file->data + off, size) != 0) {
+		lt_werrf("read of %uz bytes at %uq from '%s' returned different contents\n", size, off, file->path);
+		__atomic_fetch_add(&failures, 1, __ATOMIC_RELAXED);
+	}
+
+	close(fd);
+	__atomic_fetch_add(&reads, 1, __ATOMIC_RELAXED);
+}
+
+static
+void rewrite(stress_file_t* file, u64 off, usz size) {
+	int fd = open(file->path, O_WRONLY);
+	if (fd < 0) {
+		fail(file, "open");
+		return;
+	}
+
+	usz total = 0;
+	while (total < size) {
+		isz res = pwrite(fd, file->data + off + total, size - total, off + total);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res < 0) {
+			fail(file, "write");
+			break;
+		}
+		total += res;
+	}
+
+	close(fd);
+	__atomic_fetch_add(&writes, 1, __ATOMIC_RELAXED);
+}
+
+static
+void stress_proc(void* usr) {
+	u64 rng = (usz)usr * 0x9E3779B97F4A7C15 + 1;
+	char* buf = lt_malloc(alloc, MAX_RANGE);
+	LT_ASSERT(buf != NULL);
+
+	while (time_msec() < deadline) {
+		stress_file_t* file = &files[rand_next(&rng) % file_count];
+		u64 off = file->size ? rand_next(&rng) % file->size : 0;
+		usz size = rand_next(&rng) % MAX_RANGE;
+		if (size > file->size - off)
+			size = file->size - off;
+
+		// reads are more common, so that most of them overlap a write in progress
+		if (rand_next(&rng) % 4)
+			check_read(file, off, size, buf);
+		else
+			rewrite(file, off, size);
+	}
+
+	lt_mfree(alloc, buf);
+}
+
+static
+b8 load_file(char* path, usz size) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	stress_file_t* file = &files[file_count];
+	*file = (stress_file_t) {
+			.path = strdup(path),
+			.data = lt_malloc(alloc, size ? size : 1),
+			.size = size };
+	LT_ASSERT(file->path != NULL && file->data != NULL);
+
+	isz res = read_full(fd, file->data, size, 0);
+	close(fd);
+	if (res != size) {
+		free(file->path);
+		lt_mfree(alloc, file->data);
+		return 0;
+	}
+	++file_count;
+	return 1;
+}
+
+static
+void load_dir(char* dir_path) {
+	DIR* dir = opendir(dir_path);
+	if (!dir)
+		lt_ferrf("failed to open '%s': %s\n", dir_path, strerror(errno));
+
+	usz total = 0;
+	struct dirent* ent;
+	while ((ent = readdir(dir)) && file_count < MAX_FILES) {
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/%s", dir_path, ent->d_name);
+
+		struct stat st;
+		if (stat(path, &st) < 0 || !S_ISREG(st.st_mode) || total + st.st_size > MAX_TOTAL_SIZE)
+			continue;
+		if (load_file(path, st.st_size))
+			total += st.st_size;
+	}
+	closedir(dir);
+}
+
+static
+void create_files(char* dir_path) {
+	char* data = lt_malloc(alloc, CREATE_SIZE);
+	LT_ASSERT(data != NULL);
+
+	u64 rng = 1;
+	for (usz i = 0; i < CREATE_SIZE; i += 8) {
+		u64 w = rand_next(&rng);
+		memcpy(data + i, &w, 8);
+	}
+
+	for (usz i = 0; i < CREATE_COUNT; ++i) {
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/stress_%zu", dir_path, i);
+
+		int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+		if (fd < 0 || write(fd, data, CREATE_SIZE) != CREATE_SIZE)
+			lt_ferrf("failed to create '%s': %s\n", path, strerror(errno));
+		close(fd);
+	}
+
+	lt_mfree(alloc, data);
+}
+
+int main(int argc, char** argv) {
+	if (argc < 2 || argc > 4)
+		lt_ferrf("usage: %s DIR [THREADS] [SECONDS]\n", argv[0]);
+
+	char* dir_path = argv[1];
+	usz thread_count = argc > 2 ? strtoul(argv[2], NULL, 10) : 8;
+	usz seconds = argc > 3 ? strtoul(argv[3], NULL, 10) : 10;
+	if (!thread_count || thread_count > 256)
+		lt_ferrf("thread count must be between 1 and 256\n");
+
+	load_dir(dir_path);
+	if (!file_count) {
+		create_files(dir_path);
+		load_dir(dir_path);
+	}
+	if (!file_count)
+		lt_ferrf("no files to test in '%s'\n", dir_path);
+
+	lt_printf("testing %uz files with %uz threads for %uz seconds\n", file_count, thread_count, seconds);
+
+	deadline = time_msec() + seconds * 1000;
+
+	lt_thread_t* threads[256];
+	for (usz i = 0; i < thread_count; ++i) {
+		threads[i] = lt_thread_create(stress_proc, (void*)(i + 1), alloc);
+		if (!threads[i])
+			lt_ferrf("failed to create thread\n");
+	}
+	for (usz i = 0; i < thread_count; ++i) {
+		while (!lt_thread_join(threads[i], alloc))
+			;
+	}
+
+	// every file must still hold exactly what it started with
+	char* buf = lt_malloc(alloc, MAX_RANGE);
+	LT_ASSERT(buf != NULL);
+	for (usz i = 0; i < file_count; ++i) {
+		for (u64 off = 0; off < files[i].size; off += MAX_RANGE) {
+			usz size = files[i].size - off < MAX_RANGE ? files[i].size - off : MAX_RANGE;
+			check_read(&files[i], off, size, buf);
+		}
+	}
+	lt_mfree(alloc, buf);
+
+	lt_printf("%uq reads, %uq writes, %uq failures\n", reads, writes, failures);
+
+	for (usz i = 0; i < file_count; ++i) {
+		free(files[i].path);
+		lt_mfree(alloc, files[i].data);
+	}
+	return failures != 0;
+}
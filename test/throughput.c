@@ -0,0 +1,165 @@
+#include <lt/mem.h>
+#include <lt/io.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>
+
+#define alloc lt_libc_heap
+
+// read and write throughput of a single large file on a mounted vfs.
+//
+//   throughput DIR [SIZE_MB] [BLOCK_KB]
+//
+// a test file is written to DIR sequentially in blocks of BLOCK_KB, read back the same way,
+// then read and rewritten in random 4 KiB blocks. every pass reports its speed in MB/s.
+// the page cache of the file is dropped before each read pass, so that reads reach the vfs
+// or the backing file instead of being served from memory. run it once with passthrough
+// enabled and once with it disabled to compare the two.
+
+#define RANDOM_BLOCK LT_KB(4)
+
+static u64 rng = 1;
+
+static
+u64 time_usec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static
+u64 rand_next(void) {
+	u64 x = rng;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return rng = x;
+}
+
+static
+void report(char* name, u64 bytes, u64 usec) {
+	if (!usec)
+		usec = 1;
+	u64 mbps10 = bytes * 10 * 1000000 / LT_MB(1) / usec;
+	lt_printf("%s: %uq.%uq MB/s\n", name, mbps10 / 10, mbps10 % 10);
+}
+
+static
+int open_file(char* path, int flags) {
+	int fd = open(path, flags, 0644);
+	if (fd < 0)
+		lt_ferrf("failed to open '%s': %s\n", path, strerror(errno));
+	return fd;
+}
+
+static
+void drop_cache(char* path) {
+	int fd = open_file(path, O_RDONLY);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+}
+
+static
+void write_seq(char* path, char* buf, usz block_size, usz size) {
+	u64 start = time_usec();
+	int fd = open_file(path, O_WRONLY|O_CREAT|O_TRUNC);
+	for (usz off = 0; off < size; off += block_size) {
+		if (write(fd, buf, block_size) != block_size)
+			lt_ferrf("write to '%s' failed: %s\n", path, strerror(errno));
+	}
+	if (fsync(fd) < 0)
+		lt_ferrf("fsync of '%s' failed: %s\n", path, strerror(errno));
+	close(fd);
+	report("sequential write", size, time_usec() - start);
+}
+
+static
+void read_seq(char* path, char* buf, usz block_size, usz size) {
+	drop_cache(path);
+
+	u64 start = time_usec();
+	int fd = open_file(path, O_RDONLY);
+	usz total = 0;
+	isz res;
+	while ((res = read(fd, buf, block_size)) > 0)
+		total += res;
+	if (res < 0)
+		lt_ferrf("read from '%s' failed: %s\n", path, strerror(errno));
+	close(fd);
+	if (total != size)
+		lt_ferrf("read %uz bytes from '%s', expected %uz\n", total, path, size);
+	report("sequential read", size, time_usec() - start);
+}
+
+static
+void read_random(char* path, char* buf, usz size) {
+	drop_cache(path);
+
+	usz count = size / RANDOM_BLOCK / 4;
+	u64 start = time_usec();
+	int fd = open_file(path, O_RDONLY);
+	for (usz i = 0; i < count; ++i) {
+		u64 off = rand_next() % (size / RANDOM_BLOCK) * RANDOM_BLOCK;
+		if (pread(fd, buf, RANDOM_BLOCK, off) != RANDOM_BLOCK)
+			lt_ferrf("read from '%s' failed: %s\n", path, strerror(errno));
+	}
+	close(fd);
+	report("random read", count * RANDOM_BLOCK, time_usec() - start);
+}
+
+static
+void write_random(char* path, char* buf, usz size) {
+	usz count = size / RANDOM_BLOCK / 4;
+	u64 start = time_usec();
+	int fd = open_file(path, O_WRONLY);
+	for (usz i = 0; i < count; ++i) {
+		u64 off = rand_next() % (size / RANDOM_BLOCK) * RANDOM_BLOCK;
+		if (pwrite(fd, buf, RANDOM_BLOCK, off) != RANDOM_BLOCK)
+			lt_ferrf("write to '%s' failed: %s\n", path, strerror(errno));
+	}
+	if (fsync(fd) < 0)
+		lt_ferrf("fsync of '%s' failed: %s\n", path, strerror(errno));
+	close(fd);
+	report("random write", count * RANDOM_BLOCK, time_usec() - start);
+}
+
+int main(int argc, char** argv) {
+	if (argc < 2 || argc > 4)
+		lt_ferrf("usage: %s DIR [SIZE_MB] [BLOCK_KB]\n", argv[0]);
+
+	char* dir_path = argv[1];
+	usz size = LT_MB(argc > 2 ? strtoul(argv[2], NULL, 10) : 256);
+	usz block_size = LT_KB(argc > 3 ? strtoul(argv[3], NULL, 10) : 128);
+	if (!block_size || block_size > LT_MB(64))
+		lt_ferrf("block size must be between 1 and 65536 KiB\n");
+	if (size < block_size || size < RANDOM_BLOCK * 4)
+		lt_ferrf("file size must be at least one block\n");
+	size -= size % block_size;
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/throughput_test", dir_path);
+
+	char* buf = lt_malloc(alloc, block_size);
+	LT_ASSERT(buf != NULL);
+	for (usz i = 0; i + 8 <= block_size; i += 8) {
+		u64 w = rand_next();
+		memcpy(buf + i, &w, 8);
+	}
+
+	lt_printf("%uz MiB in blocks of %uz KiB\n", size / LT_MB(1), block_size / LT_KB(1));
+
+	write_seq(path, buf, block_size, size);
+	read_seq(path, buf, block_size, size);
+	read_random(path, buf, size);
+	write_random(path, buf, size);
+
+	unlink(path);
+	lt_mfree(alloc, buf);
+	return 0;
+}